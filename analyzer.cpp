@@ -0,0 +1,224 @@
+#include "analyzer.h"
+#include "proc.h"
+
+extern thread_local environment *global_env;
+
+thread_local bool eager_macroexpand = false;
+thread_local unsigned escape_epoch = 1;
+
+typedef cell (*analyze_fn) (const cell&, const cell&);
+
+static bool resolve(symbol *sym, const cell &scope, cell &ref)
+{
+    int depth = 0;
+    const cell *frame_iter = &scope;
+    while (frame_iter && frame_iter->car())
+    {
+        int slot = -1;
+        int index = 0;
+        const cell *iter = frame_iter->car();
+        while (iter && iter->car())
+        {
+            if (iter->car()->type == v_symbol && iter->car()->sym == sym)
+                slot = index;                   //keep the last one: a repeated name binds the later value, as it did when frames were maps.
+            index++;
+            iter = iter->cdr();
+        }
+        if (slot >= 0)
+        {
+            ref.type = v_local;
+            ref.local.depth = depth;
+            ref.local.slot = slot;
+            return true;
+        }
+        depth++;
+        frame_iter = frame_iter->cdr();
+    }
+    ref.type = v_global;
+    ref.global = global_env->lookup(sym);
+    return false;
+}
+
+static cell map_list(const cell &x, const cell &scope, int from, analyze_fn fn)     //copy of x with fn applied to every element from index `from` on.
+{
+    cell head(v_list);
+    cell *tail = &head;
+    const cell *iter = &x;
+    int index = 0;
+    while (iter && iter->car())
+    {
+        *tail = cell(index >= from? fn(*iter->car(), scope) : *iter->car(), cell(v_list));
+        tail = tail->cdr();
+        iter = iter->cdr();
+        index++;
+    }
+    if (iter && iter->type != v_list)
+        *tail = *iter;                          //dotted tail - leave it for eval to complain about.
+    return head;
+}
+
+static cell analyze_tag_or_form(const cell &x, const cell &scope)
+{
+    if (x.type == v_symbol)
+        return x;
+    return analyze(x, scope);
+}
+
+static cell analyze_quasi(const cell &x, const cell &scope)
+{
+    if (x.type != v_list || !x.car())
+        return x;
+    if (x.car()->type == v_symbol && (x.car()->sym == &sym_un_quote || x.car()->sym == &sym_splice_un_quote))
+        return map_list(x, scope, 1, analyze);
+    return map_list(x, scope, 0, analyze_quasi);
+}
+
+static cell analyze_let_binding(const cell &x, const cell &scope)
+{
+    if (x.type == v_list && x.car() && x.car()->type == v_symbol)
+        return map_list(x, scope, 1, analyze);
+    return x;
+}
+
+cell frame_symbols(const cell &args)
+{
+    cell head(v_list);
+    cell *tail = &head;
+    const cell *iter = &args;
+    while (iter && iter->car())
+    {
+        if (!(iter->car()->type == v_symbol && iter->car()->sym == &sym_rest))
+        {
+            *tail = cell(*iter->car(), cell(v_list));
+            tail = tail->cdr();
+        }
+        iter = iter->cdr();
+    }
+    return head;
+}
+
+static cell let_symbols(const cell &bindings)
+{
+    cell head(v_list);
+    cell *tail = &head;
+    const cell *iter = &bindings;
+    while (iter && iter->car())
+    {
+        *tail = cell(iter->car()->type == v_list && iter->car()->car()? *iter->car()->car() : *iter->car(), cell(v_list));
+        tail = tail->cdr();
+        iter = iter->cdr();
+    }
+    return head;
+}
+
+static cell analyze_special(const cell &x, const cell &scope, cell::proc_t form)
+{
+    cell result;
+    if (form == proc_quote || form == proc_go)
+        result = cell(*x.car(), x.cdr()? *x.cdr() : cell(v_list));
+    else if (form == proc_quasi_quote)
+        result = map_list(x, scope, 1, analyze_quasi);
+    else if (form == proc_define)
+        result = map_list(x, scope, 2, analyze);
+    else if (form == proc_tagbody)              //the tag table is built here, once, rather than on every entry.
+        return cell(cell(proc_run_tagbody), tagbody_table(map_list(*x.cdr(), scope, 0, analyze_tag_or_form)));
+    else if (form == proc_macroexpand)
+    {
+        result = cell(*x.car(), x.cdr()? *x.cdr() : cell(v_list));
+        if (x.cdr() && x.cdr()->car())          //the macro itself; its arguments stay unevaluated.
+            result = cell(*x.car(), cell(analyze(*x.cdr()->car(), scope), x.cdr()->cdr()? *x.cdr()->cdr() : cell(v_list)));
+    }
+    else if (form == proc_lambda || form == proc_macro)
+    {
+        if (!x.cdr() || !x.cdr()->car() || x.cdr()->car()->type != v_list)
+            return x;                           //malformed - let the proc report it.
+        cell frame_scope = cell(frame_symbols(*x.cdr()->car()), form == proc_lambda? scope : cell(v_list));      //macros expand with no lexical environment but their own arguments.
+        result = map_list(x, frame_scope, 2, analyze);
+    }
+    else if (form == proc_let)
+    {
+        if (!x.cdr() || !x.cdr()->car() || x.cdr()->car()->type != v_list)
+            return x;
+        cell frame_scope = cell(let_symbols(*x.cdr()->car()), scope);
+        result = map_list(x, frame_scope, 2, analyze);
+        *result.cdr()->car() = map_list(*x.cdr()->car(), scope, 0, analyze_let_binding);     //initial values are evaluated outside the new frame.
+    }
+    else
+        return map_list(x, scope, 0, analyze);
+    *result.car() = analyze(*x.car(), scope);
+    return result;
+}
+
+cell analyze(const cell &x, const cell &scope)
+{
+    if (x.type == v_symbol)
+    {
+        cell ref;
+        resolve(x.sym, scope, ref);
+        return ref;
+    }
+    if (x.type != v_list || !x.car())
+        return x;
+    const cell &head = *x.car();
+    cell ref;
+    if (head.type == v_symbol && !resolve(head.sym, scope, ref))
+    {
+        const cell &value = ref.global->value;
+        if (value.type == v_proc)
+            return analyze_special(x, scope, value.proc);
+        if (value.type != v_primitive)          //a macro - or a function, or nothing yet, either of which could be a macro by the time the call runs.
+        {
+            cell site = cell(cell(proc_macro_call), cell(cell(v_list), cell(ref, cell(scope, cell(x, cell(v_list))))));
+            if (eager_macroexpand && value.type == v_macro)
+                macro_call_expansion(*site.cdr());
+            return site;
+        }
+    }
+    return map_list(x, scope, 0, analyze);
+}
+
+cell analyze_call(const cell &x, const cell &scope)
+{
+    return map_list(x, scope, 0, analyze);
+}
+
+static const cell* global_value(const cell &head)       //the value of the global a head names - analyzed, or as read in a call site's form - or null.
+{
+    if (head.type == v_global)
+        return &head.global->value;
+    if (head.type == v_symbol)
+    {
+        std::map<symbol*, binding>::iterator iter = global_env->vars.find(head.sym);
+        if (iter != global_env->vars.end())
+            return &iter->second.value;
+    }
+    return 0;
+}
+
+static bool is_special(const cell &x, cell::proc_t form)
+{
+    if (x.type == v_proc)
+        return x.proc == form;
+    const cell *value = global_value(x);
+    return value && value->type == v_proc && value->proc == form;
+}
+
+bool frame_can_escape(const cell &body)
+{
+    if (body.type != v_list || !body.car())
+        return false;
+    const cell &head = *body.car();
+    if (is_special(head, proc_quote))
+        return false;
+    if (is_special(head, proc_lambda) || is_special(head, proc_macro))
+        return true;
+    const cell *value = global_value(head);
+    if (value && value->type == v_macro)
+        return true;
+    if (is_special(head, proc_macro_call))              //judged by what its head is now; escape_epoch moves on if that becomes a macro.
+        return frame_can_escape(*body.cdr()->cdr()->cdr()->cdr()->car());
+    for (const cell *iter = &body; iter && iter->car(); iter = iter->cdr())
+        if (frame_can_escape(*iter->car()))
+            return true;
+    return false;
+}
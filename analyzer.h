@@ -0,0 +1,27 @@
+#ifndef ANALYZER_H_INCLUDED
+#define ANALYZER_H_INCLUDED
+
+#include "parser.h"
+
+// Resolves the variable references in a form before it is evaluated.
+// A scope is a list of frames, innermost first; each frame is the list of
+// symbols bound there, in slot order. Symbols bound in the scope become
+// v_local (depth, slot) cells and everything else becomes a v_global cell
+// pointing at the binding, so eval never searches for a name at run time.
+// Quoted data, tags, and macro arguments are left as they were read.
+// A call to a macro becomes a call site, (cache head scope form), that is
+// expanded the first time it is reached and then reuses the expansion
+// until the macro is redefined. So does a call to any global but a
+// primitive, since a function, or a name not defined yet, may be a macro by
+// the time the call runs: its site analyzes it as a plain call then, and
+// again as an expansion if the name turns into a macro.
+
+cell analyze(const cell &x, const cell &scope);
+cell analyze_call(const cell &x, const cell &scope);       //x as a plain call, whatever its head names.
+cell frame_symbols(const cell &args);       //parameter list minus &REST, i.e. the slot order for a call frame.
+bool frame_can_escape(const cell &body);    //whether an analyzed body might keep its frame past the call: it has a lambda or macro, or a call to what is now a macro.
+
+extern thread_local bool eager_macroexpand;              //expand macro calls as they are analyzed, rather than when first reached.
+extern thread_local unsigned escape_epoch;               //moves on whenever an answer from frame_can_escape may have changed: a macro was made, or frames were pinned.
+
+#endif // ANALYZER_H_INCLUDED
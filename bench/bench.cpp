@@ -0,0 +1,149 @@
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <chrono>
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#endif
+
+#include "tokenizer.h"
+#include "parser.h"
+#include "proc.h"
+#include "printer.h"
+#include "heap.h"
+#include "vm.h"
+#include "globals.h"
+
+// Fixed Lisp workloads, read and evaluated the same way the interpreter
+// does it, timed one form at a time. An op is one evaluation of the
+// workload's form; the result is checked too, so a fast wrong answer fails.
+//
+//   cpplisp-bench [--vm] [name ...]
+
+struct workload
+{
+    const char *name;
+    const char *setup;          //evaluated once, untimed
+    const char *form;           //evaluated `runs` times
+    int runs;
+    const char *expect;         //what the form should print as
+};
+
+static const workload workloads[] =
+{
+    {"fib",
+        "(defun fib (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))",
+        "(fib 20)", 5, "6765"},
+    {"tak",
+        "(defun tak (x y z) (if (not (< y x)) z (tak (tak (- x 1) y z) (tak (- y 1) z x) (tak (- z 1) x y))))",
+        "(tak 18 12 6)", 5, "7"},
+    {"mapcar",
+        "(defun range (n) (let ((acc '()) (i 0)) (while (< i n) (push acc i) (setq i (+ i 1))) (nreverse acc)))"
+        "(define nums (range 10000))",
+        "(car (mapcar (lambda (x) (* x 2)) nums))", 20, "0"},
+    {"nreverse",
+        "(defun range (n) (let ((acc '()) (i 0)) (while (< i n) (push acc i) (setq i (+ i 1))) (nreverse acc)))"
+        "(define big (range 100000))",
+        "(car (setq big (nreverse (nreverse big))))", 25, "0"},
+    {"macro-loop",
+        "(defun count-evens (n) (let ((i 0) (evens 0) (even true)) (while (< i n) (when even (setq evens (+ evens 1))) (unless (< i 0) (setq even (not even))) (setq i (+ i 1))) evens))",
+        "(count-evens 100000)", 5, "50000"},
+    {"strings",
+        "(defun build (n) (let ((b (make-string-builder)) (i 0)) (while (< i n) (string-builder-append b \"piece\" (number->string i) \" \") (setq i (+ i 1))) (string-builder->string b)))",
+        "(string-length (build 10000))", 20, "98890"},
+    {"closures",
+        "(defun chain (n) (if (= n 0) (lambda (x) x) (let ((f (chain (- n 1)))) (lambda (x) (+ 1 (f x))))))"
+        "(define deep (chain 500))",
+        "(let ((i 0) (total 0)) (while (< i 200) (setq total (+ total (deep i))) (setq i (+ i 1))) total)", 5, "119900"},
+};
+
+static cell eval_source(const std::string &source, bool use_vm)     //every form in turn, as a script would be; returns the last value.
+{
+    lexer lex(source);
+    parser p(lex);
+    cell result;
+    while (!p.at_end())
+    {
+        cell expr = p.read();
+        result = use_vm? vm_eval(expr) : eval_toplevel(expr);
+    }
+    return result;
+}
+
+static long peak_rss_kb()
+{
+#if defined(__unix__) || defined(__APPLE__)
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#if defined(__APPLE__)
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+#else
+    return 0;
+#endif
+}
+
+static bool selected(const char *name, int argc, char **argv)
+{
+    bool any = false;
+    for (int i = 1; i < argc; i++)
+    {
+        if (std::string(argv[i]) == "--vm")
+            continue;
+        any = true;
+        if (name == std::string(argv[i]))
+            return true;
+    }
+    return !any;
+}
+
+int main(int argc, char **argv)
+{
+    bool use_vm = false;
+    for (int i = 1; i < argc; i++)
+        if (std::string(argv[i]) == "--vm")
+            use_vm = true;
+    gc_init();
+    setupGlobals();
+    loadPrelude();
+
+    std::cout << std::left << std::setw(12) << "workload" << std::right << std::setw(8) << "runs"
+              << std::setw(16) << "ns/op" << std::setw(14) << "allocs/op" << "\n";
+    bool ok = true;
+    for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++)
+    {
+        const workload &w = workloads[i];
+        if (!selected(w.name, argc, argv))
+            continue;
+        try
+        {
+            eval_source(w.setup, use_vm);
+            std::string result = toString(eval_source(w.form, use_vm));        //warm up, and check the answer.
+            if (result != w.expect)
+            {
+                std::cout << w.name << ": expected " << w.expect << ", got " << result << "\n";
+                ok = false;
+                continue;
+            }
+            gc_collect();
+            size_t allocs = gc_stats().total_allocs;
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            for (int run = 0; run < w.runs; run++)
+                eval_source(w.form, use_vm);
+            double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+            allocs = gc_stats().total_allocs - allocs;
+            std::cout << std::left << std::setw(12) << w.name << std::right << std::setw(8) << w.runs
+                      << std::setw(16) << std::fixed << std::setprecision(0) << ns / w.runs
+                      << std::setw(14) << (double)allocs / w.runs << "\n";
+        }
+        catch (exception e)
+        {
+            std::cout << w.name << ": " << e.err << "\n";
+            ok = false;
+        }
+    }
+    std::cout << "peak RSS: " << peak_rss_kb() << " KB\n";
+    return ok? 0 : 1;
+}
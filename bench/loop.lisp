@@ -0,0 +1,4 @@
+(time (let ((i 0)) (while (< i 1000000) (setq i (+ i 1))) i))
+(time (let ((i 0) (n 0)) (tagbody top (setq n (+ n i)) (setq i (+ i 1)) (if (< i 1000000) (go top))) n))
+(defun count-down (n) (tagbody top (when (> n 0) (setq n (- n 1)) (go top))) n)
+(time (let ((i 0)) (while (< i 1000) (count-down 1000) (setq i (+ i 1))) i))
@@ -0,0 +1,142 @@
+#include <string>
+
+#include "globals.h"
+#include "tokenizer.h"
+#include "parser.h"
+#include "proc.h"
+#include "heap.h"
+#include "image.h"
+#include "profiler.h"
+#include "hash.h"
+#include "vector.h"
+#include "sequence.h"
+#include "parallel.h"
+#include "printer.h"
+#include "text.h"
+
+extern thread_local environment *global_env;
+extern thread_local frame *env;
+
+static const primitive primitives[] =      //natives that only want their arguments' values: name, function, and the fewest and most arguments (-1 for no limit).
+{
+    {"+", prim_add, 0, -1},
+    {"-", prim_subtract, 0, -1},
+    {"*", prim_multiply, 0, -1},
+    {"/", prim_divide, 0, -1},
+    {"=", prim_equal, 1, -1},
+    {"<", prim_less, 2, 2},
+    {">", prim_greater, 2, 2},
+    {"<=", prim_less_equal, 2, 2},
+    {">=", prim_greater_equal, 2, 2},
+    {"NOT", prim_not, 1, 1},
+    {"CONS", prim_cons, 2, 2},
+    {"CAR", prim_car, 1, 1},
+    {"CDR", prim_cdr, 1, 1},
+    {"LIST", prim_list, 0, -1},
+    {"CONCAT", prim_concat, 0, -1},
+    {"SUBSTRING", prim_substring, 2, 3},
+    {"STRING-LENGTH", prim_string_length, 1, 1},
+    {"STRING->SYMBOL", prim_string_to_symbol, 1, 1},
+    {"NUMBER->STRING", prim_number_to_string, 1, 1},
+    {"MAKE-STRING-BUILDER", prim_make_string_builder, 0, 0},
+    {"STRING-BUILDER-APPEND", prim_string_builder_append, 1, -1},
+    {"STRING-BUILDER->STRING", prim_string_builder_to_string, 1, 1},
+    {"MAPCAR", prim_mapcar, 2, -1},
+    {"REDUCE", prim_reduce, 2, 3},
+    {"REMOVE-IF", prim_remove_if, 2, 2},
+    {"FILTER", prim_filter, 2, 2},
+    {"FIND", prim_find, 2, 2},
+    {"FIND-IF", prim_find_if, 2, 2},
+    {"EVERY", prim_every, 2, 2},
+    {"SOME", prim_some, 2, 2},
+    {"APPEND", prim_append, 0, -1},
+    {"LENGTH", prim_length, 1, 1},
+    {"NTH", prim_nth, 2, 2},
+};
+
+void setupGlobals()
+{
+    global_env = new environment();
+    gc_add_root(&env);
+    for (size_t i = 0; i < sizeof(primitives) / sizeof(primitives[0]); i++)
+        global_env->get(intern(primitives[i].name)) = &primitives[i];
+    global_env->get(intern("PRINT")) = proc_print;
+    global_env->get(intern("WRITE")) = proc_write;
+    global_env->get(intern("PRINT-LIMITED")) = proc_print_limited;
+    global_env->get(intern("EVAL")) = proc_eval_arglist;   //arglist interface to actual eval function.
+    global_env->get(intern("AND")) = proc_and;
+    global_env->get(intern("OR")) = proc_or;
+    global_env->get(intern("IF")) = proc_if;
+    global_env->get(intern("BEGIN")) = proc_begin;
+    global_env->get(intern("DEFINE")) = proc_define;
+    global_env->get(intern("QUOTE")) = proc_quote;
+    global_env->get(intern("QUASI-QUOTE")) = proc_quasi_quote;
+    global_env->get(intern("LAMBDA")) = proc_lambda;
+    global_env->get(intern("MACRO")) = proc_macro;
+    global_env->get(intern("MACROEXPAND-1")) = proc_macroexpand;
+    global_env->get(intern("LISTVARS")) = proc_listvars;
+    global_env->get(intern("TAGBODY")) = proc_tagbody;
+    global_env->get(intern("GO")) = proc_go;
+    global_env->get(intern("SETQ")) = proc_setq;
+    global_env->get(intern("NREVERSE")) = proc_nreverse;
+    global_env->get(intern("LET")) = proc_let;
+    global_env->get(intern("PMAPCAR")) = proc_pmapcar;
+    global_env->get(intern("PREDUCE")) = proc_preduce;
+    global_env->get(intern("SPAWN")) = proc_spawn;
+    global_env->get(intern("TOUCH")) = proc_touch;
+    global_env->get(intern("TIME")) = proc_time;
+    global_env->get(intern("GC")) = proc_gc;
+    global_env->get(intern("HEAP-STATS")) = proc_heap_stats;
+    global_env->get(intern("MAKE-HASH-TABLE")) = proc_make_hash_table;
+    global_env->get(intern("GETHASH")) = proc_gethash;
+    global_env->get(intern("SETHASH")) = proc_sethash;
+    global_env->get(intern("REMHASH")) = proc_remhash;
+    global_env->get(intern("HASH-COUNT")) = proc_hash_count;
+    global_env->get(intern("MAPHASH")) = proc_maphash;
+    global_env->get(intern("MAKE-VECTOR")) = proc_make_vector;
+    global_env->get(intern("MAKE-DOUBLE-VECTOR")) = proc_make_double_vector;
+    global_env->get(intern("VECTOR-REF")) = proc_vector_ref;
+    global_env->get(intern("VECTOR-SET!")) = proc_vector_set;
+    global_env->get(intern("VECTOR-LENGTH")) = proc_vector_length;
+    global_env->get(intern("VECTOR->LIST")) = proc_vector_to_list;
+    global_env->get(intern("LIST->VECTOR")) = proc_list_to_vector;
+    global_env->get(intern("LIST->DOUBLE-VECTOR")) = proc_list_to_double_vector;
+    global_env->get(intern("VECTOR-ADD")) = proc_vector_add;
+    global_env->get(intern("VECTOR-SUB")) = proc_vector_subtract;
+    global_env->get(intern("VECTOR-MUL")) = proc_vector_multiply;
+    global_env->get(intern("VECTOR-DIV")) = proc_vector_divide;
+    global_env->get(intern("VECTOR-SCALE")) = proc_vector_scale;
+    global_env->get(intern("VECTOR-MAP")) = proc_vector_map;
+    global_env->get(intern("VECTOR-SUM")) = proc_vector_sum;
+    global_env->get(intern("VECTOR-MIN")) = proc_vector_min;
+    global_env->get(intern("VECTOR-MAX")) = proc_vector_max;
+    global_env->get(intern("DOT")) = proc_dot;
+    global_env->get(intern("SIMD-LEVEL")) = proc_simd_level;
+    global_env->get(intern("PROFILE-START")) = proc_profile_start;
+    global_env->get(intern("PROFILE-STOP")) = proc_profile_stop;
+    global_env->get(intern("PROFILE-REPORT")) = proc_profile_report;
+    global_env->get(intern("PROFILE-FOLDED")) = proc_profile_folded;
+    global_env->get(&sym_nil) = cell(&sym_nil);
+    global_env->get(&sym_true) = cell(&sym_true);
+    image_register_natives();
+}
+
+void loadPrelude()
+{
+    std::string runOnStart =
+    "(define defmacro (macro (name vars &rest body) `(define ,name (macro ,vars ,@body))))"
+    "(defmacro defun (name vars &rest body) `(define ,name (lambda ,vars ,@body)))"
+    "(defmacro while (expr &rest body) `(tagbody top (if ,expr (begin ,@body (go top))) end))"
+    "(defmacro when (cond &rest body) `(if ,cond (begin ,@body)))"
+    "(defmacro unless (cond &rest body) `(if (not ,cond) (begin ,@body)))"
+    "(defmacro push (list arg) `(setq ,list (cons ,arg ,list)))"
+    "(defmacro future (expr) `(spawn (lambda () ,expr)))";
+    lexer lex(runOnStart);
+    parser p(lex);
+    try
+    {
+        while (true)
+            eval_toplevel(p.read());
+    }
+    catch (exception e) {}
+}
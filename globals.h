@@ -0,0 +1,12 @@
+#ifndef GLOBALS_H_INCLUDED
+#define GLOBALS_H_INCLUDED
+
+// The global environment everything else runs in. setupGlobals binds the
+// natives; loadPrelude then defines the standard macros in Lisp. Call
+// gc_init first. A program that loads an image calls setupGlobals only.
+// An interpreter (interpreter.h) does all of this for its thread.
+
+void setupGlobals();
+void loadPrelude();
+
+#endif // GLOBALS_H_INCLUDED
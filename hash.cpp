@@ -0,0 +1,278 @@
+#include <cstring>
+#include <string>
+
+#include "hash.h"
+#include "proc.h"
+#include "heap.h"
+
+static uint32_t finish_hash(uint64_t h)         //splitmix64's finaliser: every bit of the input reaches the top 32.
+{
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    uint32_t code = (uint32_t)(h >> 32);
+    return code? code : 1;                      //0 is a free slot.
+}
+
+static uint32_t hash_code(const cell &key, bool equal)
+{
+    uint64_t h;
+    cell_type type = key.type;
+    switch (key.type)
+    {
+        case v_fixnum:
+            h = (uint64_t)key.i;
+            break;
+        case v_number:
+            if (equal && key.n >= -9.2e18 && key.n <= 9.2e18 && key.n == (double)(long long)key.n)
+            {
+                h = (uint64_t)(long long)key.n;         //= matches it to the fixnum of the same value, so it hashes like one.
+                type = v_fixnum;
+            }
+            else
+                std::memcpy(&h, &key.n, sizeof(h));
+            break;
+        case v_string:
+            if (equal)
+            {
+                h = 14695981039346656037ULL;            //FNV-1a over the contents
+                for (size_t i = 0; i < key.str->size(); i++)
+                    h = (h ^ (unsigned char)(*key.str)[i]) * 1099511628211ULL;
+                break;
+            }
+            h = (uint64_t)(uintptr_t)key.str;
+            break;
+        case v_symbol:
+            h = (uint64_t)(uintptr_t)key.sym;
+            break;
+        case v_list:
+            h = (uint64_t)(uintptr_t)key.pair;
+            break;
+        case v_function:
+        case v_macro:
+            h = (uint64_t)(uintptr_t)key.func;
+            break;
+        case v_hash:
+            h = (uint64_t)(uintptr_t)key.hash;
+            break;
+        case v_vector:
+            h = (uint64_t)(uintptr_t)key.vec;
+            break;
+        case v_double_vector:
+            h = (uint64_t)(uintptr_t)key.dvec;
+            break;
+        case v_future:
+            h = (uint64_t)(uintptr_t)key.fut;
+            break;
+        case v_primitive:
+            h = (uint64_t)(uintptr_t)key.prim;
+            break;
+        case v_string_builder:
+            h = (uint64_t)(uintptr_t)key.str;
+            break;
+        default:
+            h = 0;
+            break;
+    }
+    return finish_hash(h ^ ((uint64_t)type << 56));
+}
+
+static bool same_key(const cell &a, const cell &b, bool equal)
+{
+    if (a.type != b.type)
+        return equal && a == b;
+    switch (a.type)
+    {
+        case v_fixnum:
+            return a.i == b.i;
+        case v_number:
+            return a.n == b.n;
+        case v_string:
+            return a.str == b.str || (equal && *a.str == *b.str);
+        case v_symbol:
+            return a.sym == b.sym;
+        case v_list:
+            return a.pair == b.pair;
+        case v_function:
+        case v_macro:
+            return a.func == b.func;
+        case v_proc:
+            return a.proc == b.proc;
+        case v_primitive:
+            return a.prim == b.prim;
+        case v_hash:
+            return a.hash == b.hash;
+        case v_vector:
+            return a.vec == b.vec;
+        case v_double_vector:
+            return a.dvec == b.dvec;
+        case v_future:
+            return a.fut == b.fut;
+        case v_string_builder:
+            return a.str == b.str;
+        default:
+            return false;
+    }
+}
+
+static size_t find_slot(hash_table *table, const cell &key, uint32_t code)     //the slot holding key, or the free slot ending its run.
+{
+    size_t mask = table->codes.size() - 1;
+    for (size_t i = code & mask; ; i = (i + 1) & mask)
+    {
+        if (!table->codes[i])
+            return i;
+        if (table->codes[i] == code && same_key(table->entries[i].key, key, table->equal))
+            return i;
+    }
+}
+
+static void grow(hash_table *table)         //double the size, placing entries by the codes already stored.
+{
+    std::vector<uint32_t> codes(table->codes.empty()? 8 : 2 * table->codes.size(), 0);
+    std::vector<hash_entry> entries(codes.size());
+    size_t mask = codes.size() - 1;
+    for (size_t i = 0; i < table->codes.size(); i++)
+    {
+        uint32_t code = table->codes[i];
+        if (!code)
+            continue;
+        size_t j = code & mask;
+        while (codes[j])
+            j = (j + 1) & mask;
+        codes[j] = code;
+        entries[j] = table->entries[i];
+    }
+    table->codes.swap(codes);
+    table->entries.swap(entries);
+}
+
+cell* hash_get(hash_table *table, const cell &key)
+{
+    if (!table->count)
+        return 0;
+    size_t i = find_slot(table, key, hash_code(key, table->equal));
+    return table->codes[i]? &table->entries[i].value : 0;
+}
+
+void hash_set(hash_table *table, const cell &key, const cell &value)
+{
+    if ((table->count + 1) * 4 > table->codes.size() * 3)      //keep the load under 3/4, so runs stay short.
+        grow(table);
+    uint32_t code = hash_code(key, table->equal);
+    size_t i = find_slot(table, key, code);
+    if (!table->codes[i])
+    {
+        table->codes[i] = code;
+        table->entries[i].key = key;
+        table->count++;
+    }
+    table->entries[i].value = value;
+}
+
+bool hash_remove(hash_table *table, const cell &key)
+{
+    if (!table->count)
+        return false;
+    size_t i = find_slot(table, key, hash_code(key, table->equal));
+    if (!table->codes[i])
+        return false;
+    size_t mask = table->codes.size() - 1;
+    for (size_t j = (i + 1) & mask; table->codes[j]; j = (j + 1) & mask)
+    {
+        size_t home = table->codes[j] & mask;
+        bool stays = i < j? (home > i && home <= j) : (home > i || home <= j);     //home is cyclically in (i, j]: moving it to i would hide it.
+        if (stays)
+            continue;
+        table->codes[i] = table->codes[j];
+        table->entries[i] = table->entries[j];
+        i = j;
+    }
+    table->codes[i] = 0;
+    table->entries[i] = hash_entry();           //let the collector have what it held.
+    table->count--;
+    return true;
+}
+
+
+// From Lisp.
+
+static hash_table* expect_table(const cell &c, const std::string &name)
+{
+    if (c.type != v_hash)
+        throw(exception("Error: expected hash table as argument to " + name + "."));
+    return c.hash;
+}
+
+cell proc_make_hash_table(const cell &arglist)     //(make-hash-table ['eq]): EQUAL unless asked for EQ.
+{
+    cell test;
+    if (!eval_args(arglist, &test, 1))
+        return cell();
+    bool equal = true;
+    if (test.type == v_symbol && test.sym->name == "EQ")
+        equal = false;
+    else if (!(test.type == v_symbol && (test.sym == &sym_nil || test.sym->name == "EQUAL")))
+        throw(exception("Error: make-hash-table expects EQ or EQUAL."));
+    cell result(v_hash);
+    result.hash = make_hash_table(equal);
+    return result;
+}
+
+cell proc_gethash(const cell &arglist)             //(gethash key table [default])
+{
+    cell args[3];
+    if (!eval_args(arglist, args, 3))
+        return cell();
+    cell *value = hash_get(expect_table(args[1], "gethash"), args[0]);
+    return value? *value : args[2];
+}
+
+cell proc_sethash(const cell &arglist)             //(sethash key value table): returns value.
+{
+    cell args[3];
+    if (!eval_args(arglist, args, 3))
+        return cell();
+    hash_set(expect_table(args[2], "sethash"), args[0], args[1]);
+    return args[1];
+}
+
+cell proc_remhash(const cell &arglist)             //(remhash key table): T if there was something to remove.
+{
+    cell args[2];
+    if (!eval_args(arglist, args, 2))
+        return cell();
+    return hash_remove(expect_table(args[1], "remhash"), args[0])? cell(&sym_true) : cell();
+}
+
+cell proc_hash_count(const cell &arglist)
+{
+    cell table;
+    if (!eval_args(arglist, &table, 1))
+        return cell();
+    return cell((long long)expect_table(table, "hash-count")->count);
+}
+
+cell proc_maphash(const cell &arglist)             //(maphash fn table): calls (fn key value) for each entry.
+{
+    cell args[2];
+    if (!eval_args(arglist, args, 2))
+        return cell();
+    hash_table *table = expect_table(args[1], "maphash");
+    cell snapshot(v_list);                          //fn may change the table, so walk a copy of it.
+    for (size_t i = table->codes.size(); i-- > 0;)
+        if (table->codes[i])
+            snapshot = cell(cell(table->entries[i].key, table->entries[i].value), snapshot);
+    const cell *iter = &snapshot;
+    while (iter && iter->car())
+    {
+        cell entry[2] = {*iter->car()->car(), *iter->car()->cdr()};
+        apply_function(args[0], entry, 2);
+        if (pending_go)
+            return cell();
+        iter = iter->cdr();
+    }
+    return cell();
+}
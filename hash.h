@@ -0,0 +1,41 @@
+#ifndef HASH_H_INCLUDED
+#define HASH_H_INCLUDED
+
+#include <cstdint>
+#include <vector>
+
+#include "parser.h"
+
+// Hash tables, open addressed with linear probing. A probe walks a dense
+// array of 32-bit hash codes (0 marks a free slot) and only looks at the
+// keys whose codes match, which sit at the same index in a parallel array
+// of entries. Removal shifts the rest of the probe run back instead of
+// leaving tombstones. An EQUAL table matches keys the way = does (strings
+// by contents, numbers by value); an EQ table matches the identical object.
+
+struct hash_entry
+{
+    cell key;
+    cell value;
+};
+
+struct hash_table           //lives on the collected heap; see make_hash_table.
+{
+    bool equal;
+    size_t count;
+    std::vector<uint32_t> codes;        //a power of two in size, or empty
+    std::vector<hash_entry> entries;    //the same size as codes
+};
+
+cell* hash_get(hash_table *table, const cell &key);         //the value stored under key, or null.
+void hash_set(hash_table *table, const cell &key, const cell &value);
+bool hash_remove(hash_table *table, const cell &key);       //false if key wasn't there.
+
+cell proc_make_hash_table(const cell &arglist);
+cell proc_gethash(const cell &arglist);
+cell proc_sethash(const cell &arglist);
+cell proc_remhash(const cell &arglist);
+cell proc_hash_count(const cell &arglist);
+cell proc_maphash(const cell &arglist);
+
+#endif // HASH_H_INCLUDED
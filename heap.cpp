@@ -0,0 +1,642 @@
+#include <algorithm>
+#include <chrono>
+#include <csetjmp>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <vector>
+
+#include <pthread.h>
+
+#include "heap.h"
+#include "vm.h"
+#include "hash.h"
+#include "vector.h"
+#include "parallel.h"
+
+static const size_t page_bytes = 64 * 1024;
+static const size_t max_pooled_size = 1024;             //anything bigger gets a page of its own.
+static const size_t min_gc_threshold = 32 * 1024;       //objects allocated before the first collection is considered.
+
+struct heap_page
+{
+    object_kind kind;
+    size_t slot_size;
+    size_t nslots;
+    char *slots;
+    std::vector<unsigned char> used;
+    std::vector<unsigned char> marked;
+};
+
+struct heap_pool                //one per object kind and size class, so every slot in a page has the same size and layout.
+{
+    void *free_list;
+    size_t free_count;
+    size_t capacity;
+    heap_page *last_page;       //free lists are threaded page by page, so this usually saves a search in heap_alloc.
+};
+
+static thread_local std::vector<heap_page*> pages;              //kept sorted by address so the stack scan can binary search.
+static thread_local heap_pool pools[o_nkinds][max_pooled_size / 16 + 1];
+static thread_local size_t allocated_since_gc = 0;
+static thread_local size_t gc_threshold = min_gc_threshold;
+static thread_local void *stack_base = 0;
+thread_local const char *stack_limit = 0;
+static thread_local std::vector<std::pair<object_kind, void*> > mark_stack;
+static thread_local environment *env_list = 0;
+static thread_local std::vector<frame**> frame_roots;
+static thread_local std::vector<void (*)()> markers;
+static thread_local heap_stats stats = heap_stats();
+static thread_local cell *frame_stack = 0;     //allocated the first time it's used
+thread_local size_t frame_stack_top = 0;
+thread_local size_t frame_stack_floor = 0;
+static const size_t frame_stack_cells = 65536;
+
+static_assert(offsetof(frame, slots) == sizeof(cell), "a frame's header must take one cell's room on the frame stack");
+
+void gc_init()
+{
+    pthread_attr_t attr;                    //scan up to the real top of the stack, so main's own locals are roots too.
+    void *addr;
+    size_t size;
+    pthread_getattr_np(pthread_self(), &attr);
+    pthread_attr_getstack(&attr, &addr, &size);
+    pthread_attr_destroy(&attr);
+    stack_base = (char*)addr + size;
+    stack_limit = (char*)addr + std::min(size / 4, (size_t)256 * 1024);
+}
+
+static void destroy(object_kind kind, void *obj);
+
+void gc_shutdown()
+{
+    for (size_t p = 0; p < pages.size(); p++)
+    {
+        heap_page *page = pages[p];
+        for (size_t i = 0; i < page->nslots; i++)
+            if (page->used[i])
+                destroy(page->kind, page->slots + i * page->slot_size);
+        std::free(page->slots);
+        delete page;
+    }
+    pages.clear();
+    for (int k = 0; k < o_nkinds; k++)
+        for (size_t c = 0; c <= max_pooled_size / 16; c++)
+            pools[k][c] = heap_pool();
+    allocated_since_gc = 0;
+    gc_threshold = min_gc_threshold;
+    stats = heap_stats();
+    std::free(frame_stack);
+    frame_stack = 0;
+    frame_stack_top = 0;
+    frame_stack_floor = 0;
+    stack_base = 0;
+}
+
+void gc_register_env(environment *e)
+{
+    e->prev_env = 0;
+    e->next_env = env_list;
+    if (env_list)
+        env_list->prev_env = e;
+    env_list = e;
+}
+
+void gc_unregister_env(environment *e)
+{
+    if (e->prev_env)
+        e->prev_env->next_env = e->next_env;
+    else
+        env_list = e->next_env;
+    if (e->next_env)
+        e->next_env->prev_env = e->prev_env;
+}
+
+void gc_add_root(frame **root)
+{
+    if (std::find(frame_roots.begin(), frame_roots.end(), root) == frame_roots.end())      //an interpreter made after another on the same thread adds its roots again.
+        frame_roots.push_back(root);
+}
+
+void gc_add_marker(void (*marker)())
+{
+    if (std::find(markers.begin(), markers.end(), marker) == markers.end())
+        markers.push_back(marker);
+}
+
+void gc_remove_marker(void (*marker)())
+{
+    markers.erase(std::remove(markers.begin(), markers.end(), marker), markers.end());
+}
+
+static heap_page* new_page(object_kind kind, size_t slot_size, size_t nslots)
+{
+    char *slots = (char*)std::malloc(nslots * slot_size);       //malloc alignment covers every slot layout.
+    if (!slots)
+        throw(exception("Error: out of memory."));
+    heap_page *page = new heap_page;
+    page->kind = kind;
+    page->slot_size = slot_size;
+    page->nslots = nslots;
+    page->slots = slots;
+    page->used.assign(nslots, 0);
+    page->marked.assign(nslots, 0);
+
+    struct by_address
+    {
+        bool operator()(const heap_page *a, const heap_page *b) const {return a->slots < b->slots;}
+    };
+    pages.insert(std::upper_bound(pages.begin(), pages.end(), page, by_address()), page);
+    stats.pages = pages.size();
+    stats.heap_bytes += nslots * slot_size;
+    return page;
+}
+
+static void add_page(object_kind kind, size_t slot_size)
+{
+    heap_pool &pool = pools[kind][slot_size / 16];
+    heap_page *page = new_page(kind, slot_size, page_bytes / slot_size);
+    for (size_t i = page->nslots; i-- > 0;)
+    {
+        void *slot = page->slots + i * page->slot_size;
+        *(void**)slot = pool.free_list;
+        pool.free_list = slot;
+    }
+    pool.free_count += page->nslots;
+    pool.capacity += page->nslots;
+    pool.last_page = page;
+}
+
+static heap_page* find_page(const void *p)
+{
+    struct below
+    {
+        bool operator()(const void *p, const heap_page *page) const {return (const char*)p < page->slots;}
+    };
+    std::vector<heap_page*>::iterator iter = std::upper_bound(pages.begin(), pages.end(), p, below());
+    if (iter == pages.begin())
+        return 0;
+    heap_page *page = *(iter - 1);
+    if ((const char*)p < page->slots + page->nslots * page->slot_size)
+        return page;
+    return 0;
+}
+
+static void mark_ptr(const void *p)                 //accepts interior pointers, so any word that lands inside a live object keeps it alive.
+{
+    if (!p)
+        return;
+    heap_page *page = find_page(p);
+    if (!page)
+        return;
+    size_t i = ((const char*)p - page->slots) / page->slot_size;
+    if (!page->used[i] || page->marked[i])
+        return;
+    page->marked[i] = 1;
+    if (page->kind != o_string && page->kind != o_double_vector)      //these hold no cells, so there's nothing to trace through.
+        mark_stack.push_back(std::make_pair(page->kind, (void*)(page->slots + i * page->slot_size)));
+}
+
+static void mark_value(const cell &c)
+{
+    switch (c.type)
+    {
+        case v_list:
+            mark_ptr(c.pair);
+            break;
+        case v_string:
+        case v_string_builder:
+            mark_ptr(c.str);
+            break;
+        case v_function:
+        case v_macro:
+            mark_ptr(c.func);
+            break;
+        case v_hash:
+            mark_ptr(c.hash);
+            break;
+        case v_vector:
+            mark_ptr(c.vec);
+            break;
+        case v_double_vector:
+            mark_ptr(c.dvec);
+            break;
+        case v_future:
+            mark_ptr(c.fut);
+            break;
+        default:
+            break;
+    }
+}
+
+void gc_mark_value(const cell &c)
+{
+    mark_value(c);
+}
+
+void gc_mark_ptr(const void *p)
+{
+    mark_ptr(p);
+}
+
+static void drain_mark_stack()
+{
+    while (!mark_stack.empty())
+    {
+        std::pair<object_kind, void*> obj = mark_stack.back();
+        mark_stack.pop_back();
+        switch (obj.first)
+        {
+            case o_cons:
+                mark_value(((cons*)obj.second)->car);
+                mark_value(((cons*)obj.second)->cdr);
+                break;
+            case o_closure:
+                mark_value(((closure*)obj.second)->args);
+                mark_value(((closure*)obj.second)->body);
+                mark_ptr(((closure*)obj.second)->env);
+                mark_ptr(((closure*)obj.second)->bc);
+                break;
+            case o_frame:
+            {
+                frame *f = (frame*)obj.second;
+                mark_ptr(f->parent);
+                for (size_t i = 0; i < f->nslots; i++)
+                    mark_value(f->slots[i]);
+                break;
+            }
+            case o_bytecode:
+            {
+                bytecode *b = (bytecode*)obj.second;
+                for (size_t i = 0; i < b->consts.size(); i++)
+                    mark_value(b->consts[i]);
+                for (size_t i = 0; i < b->children.size(); i++)
+                    mark_ptr(b->children[i]);
+                mark_value(b->args);
+                mark_value(b->body);
+                break;
+            }
+            case o_hash:
+            {
+                hash_table *h = (hash_table*)obj.second;
+                for (size_t i = 0; i < h->codes.size(); i++)
+                {
+                    if (!h->codes[i])
+                        continue;
+                    mark_value(h->entries[i].key);
+                    mark_value(h->entries[i].value);
+                }
+                break;
+            }
+            case o_vector:
+            {
+                cell_vector *v = (cell_vector*)obj.second;
+                for (size_t i = 0; i < v->length; i++)
+                    mark_value(v->items[i]);
+                break;
+            }
+            case o_future:
+                mark_value(((future*)obj.second)->thunk);
+                mark_value(((future*)obj.second)->value);
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+#ifdef __GNUC__
+__attribute__((noinline, no_sanitize_address))      //reads every word between here and the base, live or not, which AddressSanitizer would stop.
+#endif
+static void scan_stack()
+{
+    std::jmp_buf regs;                              //spill callee-saved registers so pointers held only in registers are seen.
+#ifdef __GNUC__
+    __builtin_unwind_init();                        //setjmp may mangle some registers (glibc does), so force a plain spill too.
+#endif
+    setjmp(regs);
+    void *top = &regs;
+    uintptr_t lo = std::min((uintptr_t)top, (uintptr_t)stack_base);
+    uintptr_t hi = std::max((uintptr_t)top, (uintptr_t)stack_base);
+    lo &= ~(uintptr_t)(sizeof(void*) - 1);
+    for (uintptr_t p = lo; p < hi; p += sizeof(void*))
+        mark_ptr(*(void**)p);
+}
+
+static void destroy(object_kind kind, void *obj)
+{
+    switch (kind)
+    {
+        case o_string:
+            ((std::string*)obj)->~basic_string();
+            break;
+        case o_bytecode:
+            ((bytecode*)obj)->~bytecode();
+            break;
+        case o_hash:
+            ((hash_table*)obj)->~hash_table();
+            break;
+        case o_future:
+            ((future*)obj)->~future();
+            break;
+        default:
+            break;
+    }
+}
+
+static size_t sweep()
+{
+    size_t freed = 0;
+    for (int k = 0; k < o_nkinds; k++)
+    {
+        for (size_t c = 0; c <= max_pooled_size / 16; c++)
+        {
+            pools[k][c].free_list = 0;
+            pools[k][c].free_count = 0;
+            pools[k][c].last_page = 0;
+        }
+    }
+    stats.live_objects = 0;
+    stats.live_bytes = 0;
+    for (size_t p = pages.size(); p-- > 0;)
+    {
+        heap_page *page = pages[p];
+        if (page->slot_size > max_pooled_size)      //a large object owns its page, so the page goes when it does.
+        {
+            if (page->marked[0])
+            {
+                page->marked[0] = 0;
+                stats.live_objects++;
+                stats.live_bytes += page->slot_size;
+                continue;
+            }
+            destroy(page->kind, page->slots);
+            stats.heap_bytes -= page->slot_size;
+            std::free(page->slots);
+            delete page;
+            pages.erase(pages.begin() + p);
+            freed++;
+            continue;
+        }
+        heap_pool &pool = pools[page->kind][page->slot_size / 16];
+        bool has_free = false;
+        for (size_t i = page->nslots; i-- > 0;)
+        {
+            void *slot = page->slots + i * page->slot_size;
+            if (page->used[i] && !page->marked[i])
+            {
+                destroy(page->kind, slot);
+                page->used[i] = 0;
+                freed++;
+            }
+            page->marked[i] = 0;
+            if (page->used[i])
+            {
+                stats.live_objects++;
+                stats.live_bytes += page->slot_size;
+            }
+            else
+            {
+                *(void**)slot = pool.free_list;
+                pool.free_list = slot;
+                pool.free_count++;
+                has_free = true;
+            }
+        }
+        if (has_free)
+            pool.last_page = page;
+    }
+    stats.pages = pages.size();
+    return freed;
+}
+
+static size_t frame_cells(size_t nslots)
+{
+    return 1 + (nslots? nslots : 1);
+}
+
+static void mark_frame_stack()
+{
+    for (size_t i = 0; i < frame_stack_top; )
+    {
+        frame *f = (frame*)(frame_stack + i);
+        mark_ptr(f->parent);
+        for (size_t j = 0; j < f->nslots; j++)
+            mark_value(f->slots[j]);
+        i += frame_cells(f->nslots);
+    }
+}
+
+size_t gc_collect()
+{
+    if (!stack_base)
+        return 0;                                   //gc_init hasn't run: we can't see the stack, so nothing is provably dead.
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    for (environment *e = env_list; e; e = e->next_env)
+    {
+        std::map<symbol*, binding>::iterator iter;
+        for (iter = e->vars.begin(); iter != e->vars.end(); iter++)
+            mark_value(iter->second.value);
+    }
+    for (size_t i = 0; i < frame_roots.size(); i++)
+        mark_ptr(*frame_roots[i]);
+    for (size_t i = 0; i < markers.size(); i++)
+        markers[i]();
+    mark_frame_stack();
+    scan_stack();
+    drain_mark_stack();
+    size_t freed = sweep();
+
+    stats.total_freed += freed;
+    stats.collections++;
+    allocated_since_gc = 0;
+    gc_threshold = std::max(min_gc_threshold, stats.live_objects);    //let the heap grow to roughly twice the live set.
+
+    double pause = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    stats.last_pause_ms = pause;
+    stats.max_pause_ms = std::max(stats.max_pause_ms, pause);
+    stats.total_pause_ms += pause;
+    return freed;
+}
+
+void* heap_alloc(object_kind kind, size_t size)
+{
+    size = (size + 15) & ~(size_t)15;
+    if (size > max_pooled_size)
+    {
+        if (allocated_since_gc >= gc_threshold)
+            gc_collect();
+        heap_page *page = new_page(kind, size, 1);
+        page->used[0] = 1;
+        allocated_since_gc++;
+        stats.total_allocs++;
+        stats.live_objects++;
+        stats.live_bytes += size;
+        return page->slots;
+    }
+
+    heap_pool &pool = pools[kind][size / 16];
+    if (!pool.free_list)
+    {
+        if (allocated_since_gc >= gc_threshold)
+            gc_collect();
+        if (pool.free_count < pool.capacity / 4 || !pool.free_list)    //collection didn't buy enough room - grow instead of thrashing.
+            add_page(kind, size);
+    }
+    void *slot = pool.free_list;
+    pool.free_list = *(void**)slot;
+    pool.free_count--;
+    heap_page *page = pool.last_page;
+    if (!page || (char*)slot < page->slots || (char*)slot >= page->slots + page->nslots * page->slot_size)
+        page = pool.last_page = find_page(slot);
+    page->used[((char*)slot - page->slots) / page->slot_size] = 1;
+    allocated_since_gc++;
+    stats.total_allocs++;
+    stats.live_objects++;
+    stats.live_bytes += size;
+    return slot;
+}
+
+heap_stats gc_stats()
+{
+    heap_stats s = stats;
+    s.free_objects = 0;
+    for (int k = 0; k < o_nkinds; k++)
+        for (size_t c = 0; c <= max_pooled_size / 16; c++)
+            s.free_objects += pools[k][c].free_count;
+    return s;
+}
+
+size_t gc_total_allocs()
+{
+    return stats.total_allocs;
+}
+
+cell make_cons(const cell &car, const cell &cdr)
+{
+    cell result(v_list);
+    result.pair = new (heap_alloc(o_cons, sizeof(cons))) cons;
+    result.pair->car = car;
+    result.pair->cdr = cdr;
+    return result;
+}
+
+std::string* make_string(const std::string &str)
+{
+    return new (heap_alloc(o_string, sizeof(std::string))) std::string(str);
+}
+
+closure* make_closure(const cell &args, const cell &body, frame *env, size_t nslots)
+{
+    closure *func = new (heap_alloc(o_closure, sizeof(closure))) closure;
+    func->args = args;
+    func->body = body;
+    func->env = env;
+    func->nslots = nslots;
+    func->bc = 0;
+    func->name = 0;
+    func->stack_frame = false;
+    func->frame_check = 0;
+    return func;
+}
+
+frame* make_frame(frame *parent, size_t nslots)
+{
+    frame *f = (frame*)heap_alloc(o_frame, offsetof(frame, slots) + (nslots? nslots : 1) * sizeof(cell));
+    f->parent = parent;
+    f->nslots = nslots;
+    for (size_t i = 0; i < nslots; i++)
+        new (&f->slots[i]) cell();
+    return f;
+}
+
+frame* push_frame(frame *parent, size_t nslots)
+{
+    if (!frame_stack)
+        frame_stack = (cell*)std::malloc(frame_stack_cells * sizeof(cell));
+    size_t size = frame_cells(nslots);
+    if (!frame_stack || frame_stack_top + size > frame_stack_cells)
+        return 0;
+    frame *f = (frame*)(frame_stack + frame_stack_top);
+    frame_stack_top += size;
+    f->parent = parent;
+    f->nslots = nslots;
+    for (size_t i = 0; i < nslots; i++)
+        new (&f->slots[i]) cell();
+    return f;
+}
+
+frame* settle_frame(frame *f, size_t top)
+{
+    if (top < frame_stack_floor)
+        top = frame_stack_floor;
+    size_t size = frame_cells(f->nslots);
+    cell *to = frame_stack + top;
+    if ((cell*)f != to)
+        std::memmove((void*)to, (void*)f, size * sizeof(cell));
+    frame_stack_top = top + size;
+    return (frame*)to;
+}
+
+bool on_frame_stack(const frame *f)
+{
+    return frame_stack && (const cell*)f >= frame_stack + frame_stack_floor && (const cell*)f < frame_stack + frame_stack_cells;
+}
+
+void pin_frame_stack()
+{
+    frame_stack_floor = frame_stack_top;
+}
+
+bytecode* make_bytecode()
+{
+    bytecode *b = new (heap_alloc(o_bytecode, sizeof(bytecode))) bytecode;
+    b->nslots = 0;
+    b->nparams = 0;
+    b->rest = rest_none;
+    b->max_stack = 0;
+    return b;
+}
+
+hash_table* make_hash_table(bool equal)
+{
+    hash_table *h = new (heap_alloc(o_hash, sizeof(hash_table))) hash_table;
+    h->equal = equal;
+    h->count = 0;
+    return h;
+}
+
+static void check_vector_size(size_t header, size_t length, size_t item_size)      //so the size heap_alloc rounds up can't wrap round to something small.
+{
+    if (length > (SIZE_MAX - header - 15) / item_size)
+        throw(exception("Error: vector too long."));
+}
+
+cell_vector* make_vector(size_t length)
+{
+    check_vector_size(offsetof(cell_vector, items), length, sizeof(cell));
+    cell_vector *v = (cell_vector*)heap_alloc(o_vector, offsetof(cell_vector, items) + (length? length : 1) * sizeof(cell));
+    v->length = length;
+    for (size_t i = 0; i < length; i++)
+        new (&v->items[i]) cell();
+    return v;
+}
+
+double_vector* make_double_vector(size_t length)
+{
+    check_vector_size(offsetof(double_vector, items), length, sizeof(double));
+    double_vector *v = (double_vector*)heap_alloc(o_double_vector, offsetof(double_vector, items) + (length? length : 1) * sizeof(double));
+    v->length = length;
+    return v;
+}
+
+future* make_future(const cell &thunk)
+{
+    future *f = new (heap_alloc(o_future, sizeof(future))) future;
+    f->thunk = thunk;
+    f->ready = false;
+    return f;
+}
@@ -0,0 +1,85 @@
+#ifndef HEAP_H_INCLUDED
+#define HEAP_H_INCLUDED
+
+#include <cstddef>
+
+#include "parser.h"
+
+// Managed heap for the objects cells point at (conses, strings, closures,
+// call frames, compiled code, hash tables, vectors, futures). Objects come out of page-sized arenas, one set of pages per
+// object kind and 16-byte size class, and are reclaimed by a mark-and-sweep
+// collector. Roots are the global environments, any registered frame
+// pointers, the frame stack, and a conservative scan of the C++ stack (and spilled registers)
+// of the evaluating thread. Each thread has a heap of its own, and nothing
+// on one may be handed to another.
+
+typedef enum
+{
+    o_free = 0,
+    o_cons,
+    o_string,
+    o_closure,
+    o_frame,
+    o_bytecode,
+    o_hash,
+    o_vector,
+    o_double_vector,
+    o_future,
+    o_nkinds
+} object_kind;
+
+struct heap_stats
+{
+    size_t live_objects;        //objects in use after the last sweep, plus anything allocated since
+    size_t live_bytes;
+    size_t free_objects;
+    size_t heap_bytes;          //bytes reserved for arenas
+    size_t pages;
+    size_t collections;
+    size_t total_allocs;
+    size_t total_freed;
+    double last_pause_ms;
+    double max_pause_ms;
+    double total_pause_ms;
+};
+
+void gc_init();                     //call once from the thread that will run the evaluator.
+void gc_shutdown();                 //free everything on this thread's heap, live or not; gc_init starts it afresh.
+extern thread_local const char *stack_limit;     //set by gc_init: recursing below this leaves too little stack to recover, so evaluators stop there.
+void* heap_alloc(object_kind kind, size_t size);
+size_t gc_collect();                //returns number of objects freed.
+heap_stats gc_stats();
+size_t gc_total_allocs();         //the same count gc_stats has, without the walk over the pools.
+
+void gc_register_env(environment *e);
+void gc_unregister_env(environment *e);
+void gc_add_root(frame **root);     //a frame pointer that lives outside the stack, e.g. the current lexical environment.
+void gc_add_marker(void (*marker)());   //called during marking, to mark roots the collector can't find itself. Stays until removed, across gc_shutdown.
+void gc_remove_marker(void (*marker)());
+void gc_mark_value(const cell &c);
+void gc_mark_ptr(const void *p);
+
+cell make_cons(const cell &car, const cell &cdr);
+std::string* make_string(const std::string &str);
+closure* make_closure(const cell &args, const cell &body, frame *env, size_t nslots);
+frame* make_frame(frame *parent, size_t nslots);      //slots start out as NIL
+bytecode* make_bytecode();
+hash_table* make_hash_table(bool equal);
+cell_vector* make_vector(size_t length);                 //items start out as NIL
+double_vector* make_double_vector(size_t length);        //items are left uninitialised
+future* make_future(const cell &thunk);
+
+// Calls to a closure with stack_frame set take their frame from a stack of
+// its own on each thread rather than from the heap, and drop it on return
+// by resetting frame_stack_top to where it was before the call - but never
+// below frame_stack_floor. Frames under the floor have been pinned: a
+// closure was made that holds on to them after all, so they stay where they
+// are, are marked like any other frame, and count as off the stack.
+extern thread_local size_t frame_stack_top;     //cells in use on the frame stack
+extern thread_local size_t frame_stack_floor;
+frame* push_frame(frame *parent, size_t nslots);     //slots start out as NIL. Null if the frame stack is full, so use make_frame.
+frame* settle_frame(frame *f, size_t top);     //moves f down to top and drops everything above it: a tail call's frame replacing its caller's.
+bool on_frame_stack(const frame *f);       //false for a pinned frame.
+void pin_frame_stack();                     //pins every frame on the stack now.
+
+#endif // HEAP_H_INCLUDED
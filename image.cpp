@@ -0,0 +1,663 @@
+#include <fstream>
+#include <sstream>
+#include <unordered_set>
+#include <map>
+#include <unordered_map>
+#include <vector>
+#include <cstdint>
+
+#include "image.h"
+#include "parser.h"
+#include "proc.h"
+#include "heap.h"
+#include "hash.h"
+#include "vector.h"
+
+extern thread_local environment *global_env;
+
+static const char image_magic[8] = {'C', 'P', 'L', 'I', 'M', 'G', 0, 0};
+static const uint32_t image_version = 6;
+static const uint32_t no_object = 0xffffffff;
+
+static thread_local std::vector<std::pair<std::string, cell> > natives;     //procs and primitives, in registration order; the name is what an image stores.
+
+void image_register_natives()
+{
+    natives.clear();
+    std::map<std::string, cell> sorted;         //by name, so the table doesn't depend on symbol addresses.
+    std::map<symbol*, binding>::iterator iter;
+    for (iter = global_env->vars.begin(); iter != global_env->vars.end(); iter++)
+        if (iter->second.value.type == v_proc || iter->second.value.type == v_primitive)
+            sorted[iter->first->name] = iter->second.value;
+    sorted["%MACRO-CALL"] = cell(proc_macro_call);      //not bound to anything, but the analyzer puts them in code.
+    sorted["%RUN-TAGBODY"] = cell(proc_run_tagbody);
+    std::map<std::string, cell>::iterator sorted_iter;
+    for (sorted_iter = sorted.begin(); sorted_iter != sorted.end(); sorted_iter++)
+        natives.push_back(*sorted_iter);
+}
+
+
+// Writing. Everything reachable from the globals is numbered first, then
+// written out as a table of objects that refer to each other by number.
+
+struct image_writer
+{
+    std::ostream *out;
+    std::unordered_map<symbol*, uint32_t> symbol_index;
+    std::vector<symbol*> symbols;
+    std::unordered_map<const void*, uint32_t> object_index;
+    std::vector<std::pair<object_kind, const void*> > objects;
+    bool follow_globals;                    //take along the value of each global the objects refer to
+    std::unordered_set<binding*> seen_globals;
+    std::vector<binding*> globals;
+
+    image_writer() {out = 0; follow_globals = false;}
+    template <typename T> void put(T value) {out->write((const char*)&value, sizeof(T));}
+    void put_string(const std::string &str)
+    {
+        put((uint32_t)str.size());
+        out->write(str.data(), str.size());
+    }
+
+    uint32_t add_symbol(symbol *sym)
+    {
+        std::unordered_map<symbol*, uint32_t>::iterator iter = symbol_index.find(sym);
+        if (iter != symbol_index.end())
+            return iter->second;
+        symbol_index[sym] = symbols.size();
+        symbols.push_back(sym);
+        return symbols.size() - 1;
+    }
+
+    uint32_t add_object(object_kind kind, const void *p)
+    {
+        if (!p)
+            return no_object;
+        std::unordered_map<const void*, uint32_t>::iterator iter = object_index.find(p);
+        if (iter != object_index.end())
+            return iter->second;
+        object_index[p] = objects.size();
+        objects.push_back(std::make_pair(kind, p));
+        return objects.size() - 1;
+    }
+
+    uint32_t add_native(const cell &c)
+    {
+        for (size_t i = 0; i < natives.size(); i++)
+            if (natives[i].second.type == c.type && (c.type == v_proc? natives[i].second.proc == c.proc : natives[i].second.prim == c.prim))
+                return i;
+        throw(exception("Error: can't save an image holding an unregistered native function."));
+    }
+
+    void add_cell(const cell &c)
+    {
+        switch (c.type)
+        {
+            case v_symbol:
+                add_symbol(c.sym);
+                break;
+            case v_global:
+                add_symbol(c.global->name);
+                if (follow_globals && seen_globals.insert(c.global).second)
+                {
+                    globals.push_back(c.global);
+                    add_cell(c.global->value);
+                }
+                break;
+            case v_string:
+            case v_string_builder:
+                add_object(o_string, c.str);
+                break;
+            case v_list:
+                add_object(o_cons, c.pair);
+                break;
+            case v_function:
+            case v_macro:
+                add_object(o_closure, c.func);
+                break;
+            case v_proc:
+            case v_primitive:
+                add_native(c);
+                break;
+            case v_hash:
+                add_object(o_hash, c.hash);
+                break;
+            case v_vector:
+                add_object(o_vector, c.vec);
+                break;
+            case v_double_vector:
+                add_object(o_double_vector, c.dvec);
+                break;
+            case v_future:
+                throw(exception("Error: a future can't be saved or sent to another thread."));
+            default:
+                break;
+        }
+    }
+
+    void add_contents(object_kind kind, const void *p)
+    {
+        if (kind == o_cons)
+        {
+            add_cell(((const cons*)p)->car);
+            add_cell(((const cons*)p)->cdr);
+        }
+        else if (kind == o_closure)
+        {
+            const closure *func = (const closure*)p;
+            add_cell(func->args);
+            add_cell(func->body);
+            add_object(o_frame, func->env);
+            add_cell(func->name? cell(func->name) : cell());
+        }
+        else if (kind == o_frame)
+        {
+            const frame *f = (const frame*)p;
+            add_object(o_frame, f->parent);
+            for (size_t i = 0; i < f->nslots; i++)
+                add_cell(f->slots[i]);
+        }
+        else if (kind == o_hash)
+        {
+            const hash_table *h = (const hash_table*)p;
+            for (size_t i = 0; i < h->codes.size(); i++)
+            {
+                if (!h->codes[i])
+                    continue;
+                add_cell(h->entries[i].key);
+                add_cell(h->entries[i].value);
+            }
+        }
+        else if (kind == o_vector)
+        {
+            const cell_vector *v = (const cell_vector*)p;
+            for (size_t i = 0; i < v->length; i++)
+                add_cell(v->items[i]);
+        }
+    }
+
+    void put_cell(const cell &c)
+    {
+        put((uint8_t)c.type);
+        switch (c.type)
+        {
+            case v_symbol:
+                put(symbol_index[c.sym]);
+                break;
+            case v_global:
+                put(symbol_index[c.global->name]);
+                break;
+            case v_number:
+                put(c.n);
+                break;
+            case v_fixnum:
+                put((int64_t)c.i);
+                break;
+            case v_string:
+            case v_string_builder:
+                put(object_index[c.str]);
+                break;
+            case v_list:
+                put(c.pair? object_index[c.pair] : no_object);
+                break;
+            case v_function:
+            case v_macro:
+                put(c.func? object_index[c.func] : no_object);
+                break;
+            case v_proc:
+            case v_primitive:
+                put(add_native(c));
+                break;
+            case v_hash:
+                put(object_index[c.hash]);
+                break;
+            case v_vector:
+                put(object_index[c.vec]);
+                break;
+            case v_double_vector:
+                put(object_index[c.dvec]);
+                break;
+            case v_local:
+                put((int32_t)c.local.depth);
+                put((int32_t)c.local.slot);
+                break;
+            case v_future:          //add_cell turns these away before anything is written.
+                throw(exception("Error: a future can't be saved or sent to another thread."));
+        }
+    }
+
+    void walk()             //a breadth-first walk of the heap from what's been added: objects grows as we go.
+    {
+        for (size_t i = 0; i < objects.size(); i++)
+            add_contents(objects[i].first, objects[i].second);
+    }
+
+    void put_table()        //the symbols, natives and objects walk found.
+    {
+        put((uint32_t)symbols.size());
+        for (size_t i = 0; i < symbols.size(); i++)
+            put_string(symbols[i]->name);
+        put((uint32_t)natives.size());
+        for (size_t i = 0; i < natives.size(); i++)
+            put_string(natives[i].first);
+        put((uint32_t)objects.size());
+        for (size_t i = 0; i < objects.size(); i++)        //headers: enough to allocate everything before filling it in.
+        {
+            put((uint8_t)objects[i].first);
+            if (objects[i].first == o_string)
+                put_string(*(const std::string*)objects[i].second);
+            else if (objects[i].first == o_closure)
+                put((uint64_t)((const closure*)objects[i].second)->nslots);
+            else if (objects[i].first == o_frame)
+                put((uint64_t)((const frame*)objects[i].second)->nslots);
+            else if (objects[i].first == o_hash)
+                put((uint8_t)((const hash_table*)objects[i].second)->equal);
+            else if (objects[i].first == o_vector)
+                put((uint64_t)((const cell_vector*)objects[i].second)->length);
+            else if (objects[i].first == o_double_vector)
+                put((uint64_t)((const double_vector*)objects[i].second)->length);
+        }
+        for (size_t i = 0; i < objects.size(); i++)
+        {
+            const void *p = objects[i].second;
+            if (objects[i].first == o_cons)
+            {
+                put_cell(((const cons*)p)->car);
+                put_cell(((const cons*)p)->cdr);
+            }
+            else if (objects[i].first == o_closure)
+            {
+                const closure *func = (const closure*)p;
+                put_cell(func->args);
+                put_cell(func->body);
+                put(func->env? object_index[func->env] : no_object);
+                put_cell(func->name? cell(func->name) : cell());
+            }
+            else if (objects[i].first == o_frame)
+            {
+                const frame *f = (const frame*)p;
+                put(f->parent? object_index[f->parent] : no_object);
+                for (size_t j = 0; j < f->nslots; j++)
+                    put_cell(f->slots[j]);
+            }
+            else if (objects[i].first == o_hash)      //entries only: the codes are worked out again, since eq keys hash by address.
+            {
+                const hash_table *h = (const hash_table*)p;
+                put((uint64_t)h->count);
+                for (size_t j = 0; j < h->codes.size(); j++)
+                {
+                    if (!h->codes[j])
+                        continue;
+                    put_cell(h->entries[j].key);
+                    put_cell(h->entries[j].value);
+                }
+            }
+            else if (objects[i].first == o_vector)
+            {
+                const cell_vector *v = (const cell_vector*)p;
+                for (size_t j = 0; j < v->length; j++)
+                    put_cell(v->items[j]);
+            }
+            else if (objects[i].first == o_double_vector)
+            {
+                const double_vector *v = (const double_vector*)p;
+                for (size_t j = 0; j < v->length; j++)
+                    put(v->items[j]);
+            }
+        }
+    }
+};
+
+void save_image(const std::string &path)
+{
+    image_writer w;
+    std::map<symbol*, binding>::iterator iter;
+    for (iter = global_env->vars.begin(); iter != global_env->vars.end(); iter++)
+    {
+        w.add_symbol(iter->first);
+        w.add_cell(iter->second.value);
+    }
+    w.walk();
+
+    std::ofstream out(path.c_str(), std::ios::binary);
+    if (!out)
+        throw(exception("Error: can't write image " + path));
+    w.out = &out;
+    out.write(image_magic, sizeof(image_magic));
+    w.put(image_version);
+    w.put_table();
+    w.put((uint32_t)global_env->vars.size());
+    for (iter = global_env->vars.begin(); iter != global_env->vars.end(); iter++)
+    {
+        w.put(w.symbol_index[iter->first]);
+        w.put_cell(iter->second.value);
+    }
+    out.flush();
+    if (!out)
+        throw(exception("Error: failed writing image " + path));
+}
+
+std::string pack_value(const cell &x, bool with_globals)
+{
+    image_writer w;
+    w.follow_globals = with_globals;
+    w.add_cell(x);
+    w.walk();
+    std::ostringstream out;
+    w.out = &out;
+    w.put_table();
+    w.put_cell(x);
+    w.put((uint32_t)w.globals.size());
+    for (size_t i = 0; i < w.globals.size(); i++)
+    {
+        w.put(w.symbol_index[w.globals[i]->name]);
+        w.put_cell(w.globals[i]->value);
+    }
+    return out.str();
+}
+
+
+// Reading. Every object is allocated up front, so references can be
+// resolved in any order; until they're all linked to the globals, the
+// collector finds them through mark_loading.
+
+static thread_local std::vector<std::pair<object_kind, void*> > *loading = 0;
+
+static void mark_loading()
+{
+    if (!loading)
+        return;
+    for (size_t i = 0; i < loading->size(); i++)
+        gc_mark_ptr((*loading)[i].second);
+}
+
+struct image_reader
+{
+    std::istream *in;
+    std::vector<symbol*> symbols;
+    std::vector<cell> procs;
+    std::vector<std::pair<object_kind, void*> > objects;
+
+    size_t end;             //the length of the data, to check counts read from it against
+
+    void corrupt() {throw(exception("Error: image is truncated or corrupt."));}
+
+    void start(std::istream &stream)
+    {
+        in = &stream;
+        std::streampos here = in->tellg();
+        in->seekg(0, std::ios::end);
+        end = (size_t)in->tellg();
+        in->seekg(here);
+    }
+
+    void expect(uint64_t count, size_t bytes_each)      //count things still to read, each taking at least bytes_each: more than the rest of the data holds means corruption, not a huge allocation.
+    {
+        size_t here = (size_t)in->tellg();
+        if (here > end || count > (end - here) / bytes_each)
+            corrupt();
+    }
+
+    template <typename T> T get()
+    {
+        T value;
+        if (!in->read((char*)&value, sizeof(T)))
+            corrupt();
+        return value;
+    }
+    std::string get_string()
+    {
+        uint32_t size = get<uint32_t>();
+        expect(size, 1);
+        std::string str(size, '\0');
+        if (size && !in->read(&str[0], size))
+            corrupt();
+        return str;
+    }
+
+    size_t get_length(size_t bytes_each)           //of an object whose items come later in the data.
+    {
+        uint64_t length = get<uint64_t>();
+        expect(length, bytes_each);
+        return (size_t)length;
+    }
+
+    symbol* get_symbol()
+    {
+        uint32_t index = get<uint32_t>();
+        if (index >= symbols.size())
+            corrupt();
+        return symbols[index];
+    }
+
+    void* get_object(object_kind kind)      //null for no_object
+    {
+        uint32_t index = get<uint32_t>();
+        if (index == no_object)
+            return 0;
+        if (index >= objects.size() || objects[index].first != kind)
+            corrupt();
+        return objects[index].second;
+    }
+
+    cell get_cell()
+    {
+        cell c;
+        c.type = (cell_type)get<uint8_t>();
+        switch (c.type)
+        {
+            case v_symbol:
+                c.sym = get_symbol();
+                break;
+            case v_global:
+                c.global = global_env->lookup(get_symbol());
+                break;
+            case v_number:
+                c.n = get<double>();
+                break;
+            case v_fixnum:
+                c.i = get<int64_t>();
+                break;
+            case v_string:
+            case v_string_builder:
+                c.str = (std::string*)get_object(o_string);
+                if (!c.str)
+                    corrupt();
+                break;
+            case v_list:
+                c.pair = (cons*)get_object(o_cons);
+                break;
+            case v_function:
+            case v_macro:
+                c.func = (closure*)get_object(o_closure);
+                break;
+            case v_proc:
+            case v_primitive:
+            {
+                uint32_t index = get<uint32_t>();
+                if (index >= procs.size())
+                    corrupt();
+                c = procs[index];           //by name, so an image from before a native became a primitive still loads.
+                break;
+            }
+            case v_local:
+                c.local.depth = get<int32_t>();
+                c.local.slot = get<int32_t>();
+                break;
+            case v_hash:
+                c.hash = (hash_table*)get_object(o_hash);
+                if (!c.hash)
+                    corrupt();
+                break;
+            case v_vector:
+                c.vec = (cell_vector*)get_object(o_vector);
+                if (!c.vec)
+                    corrupt();
+                break;
+            case v_double_vector:
+                c.dvec = (double_vector*)get_object(o_double_vector);
+                if (!c.dvec)
+                    corrupt();
+                break;
+            default:
+                corrupt();
+        }
+        return c;
+    }
+
+    void get_table()        //everything put_table wrote. Hold a loading_guard over the objects until they're linked to something the collector can see.
+    {
+        uint32_t nsymbols = get<uint32_t>();
+        expect(nsymbols, sizeof(uint32_t));
+        for (uint32_t i = 0; i < nsymbols; i++)
+            symbols.push_back(intern(get_string()));
+        uint32_t nprocs = get<uint32_t>();
+        expect(nprocs, sizeof(uint32_t));
+        for (uint32_t i = 0; i < nprocs; i++)
+        {
+            std::string name = get_string();
+            size_t j = 0;
+            while (j < natives.size() && natives[j].first != name)
+                j++;
+            if (j == natives.size())
+                throw(exception("Error: image needs native function " + name + ", which this build doesn't have."));
+            procs.push_back(natives[j].second);
+        }
+
+        uint32_t nobjects = get<uint32_t>();
+        expect(nobjects, 2);                        //a kind byte up front, and at least one more for its contents
+        objects.reserve(nobjects);
+        for (uint32_t i = 0; i < nobjects; i++)
+        {
+            object_kind kind = (object_kind)get<uint8_t>();
+            void *p = 0;
+            if (kind == o_cons)
+                p = make_cons(cell(), cell()).pair;
+            else if (kind == o_string)
+                p = make_string(get_string());
+            else if (kind == o_closure)
+                p = make_closure(cell(), cell(), 0, get<uint64_t>());
+            else if (kind == o_frame)
+                p = make_frame(0, get_length(1));
+            else if (kind == o_hash)
+                p = make_hash_table(get<uint8_t>() != 0);
+            else if (kind == o_vector)
+                p = make_vector(get_length(1));
+            else if (kind == o_double_vector)
+                p = make_double_vector(get_length(sizeof(double)));
+            else
+                corrupt();
+            objects.push_back(std::make_pair(kind, p));
+        }
+        for (uint32_t i = 0; i < nobjects; i++)
+        {
+            void *p = objects[i].second;
+            if (objects[i].first == o_cons)
+            {
+                ((cons*)p)->car = get_cell();
+                ((cons*)p)->cdr = get_cell();
+            }
+            else if (objects[i].first == o_closure)
+            {
+                closure *func = (closure*)p;
+                func->args = get_cell();
+                func->body = get_cell();
+                func->env = (frame*)get_object(o_frame);
+                cell name = get_cell();
+                func->name = name.type == v_symbol && name.sym != &sym_nil? name.sym : 0;
+            }
+            else if (objects[i].first == o_frame)
+            {
+                frame *f = (frame*)p;
+                f->parent = (frame*)get_object(o_frame);
+                for (size_t j = 0; j < f->nslots; j++)
+                    f->slots[j] = get_cell();
+            }
+            else if (objects[i].first == o_hash)      //every object exists by now, so the keys hash as they will from here on.
+            {
+                hash_table *h = (hash_table*)p;
+                uint64_t count = get<uint64_t>();
+                for (uint64_t j = 0; j < count; j++)
+                {
+                    cell key = get_cell();
+                    hash_set(h, key, get_cell());
+                }
+            }
+            else if (objects[i].first == o_vector)
+            {
+                cell_vector *v = (cell_vector*)p;
+                for (size_t j = 0; j < v->length; j++)
+                    v->items[j] = get_cell();
+            }
+            else if (objects[i].first == o_double_vector)
+            {
+                double_vector *v = (double_vector*)p;
+                for (size_t j = 0; j < v->length; j++)
+                    v->items[j] = get<double>();
+            }
+        }
+    }
+};
+
+struct loading_guard
+{
+    loading_guard(std::vector<std::pair<object_kind, void*> > *objects)
+    {
+        static thread_local bool registered = false;
+        if (!registered)
+        {
+            gc_add_marker(mark_loading);
+            registered = true;
+        }
+        loading = objects;
+    }
+    ~loading_guard() {loading = 0;}
+};
+
+void load_image(const std::string &path)
+{
+    std::ifstream in(path.c_str(), std::ios::binary);
+    if (!in)
+        throw(exception("Error: can't read image " + path));
+    char magic[sizeof(image_magic)];
+    if (!in.read(magic, sizeof(magic)) || std::string(magic, sizeof(magic)) != std::string(image_magic, sizeof(image_magic)))
+        throw(exception("Error: " + path + " is not an image."));
+    image_reader r;
+    r.start(in);
+    if (r.get<uint32_t>() != image_version)
+        throw(exception("Error: " + path + " was written by a different version."));
+    loading_guard guard(&r.objects);
+    r.get_table();
+    uint32_t nglobals = r.get<uint32_t>();
+    for (uint32_t i = 0; i < nglobals; i++)
+    {
+        symbol *sym = r.get_symbol();
+        global_env->get(sym) = r.get_cell();
+    }
+}
+
+cell unpack_value(const std::string &data, cell *replaced)
+{
+    std::istringstream in(data);
+    image_reader r;
+    r.start(in);
+    loading_guard guard(&r.objects);
+    r.get_table();
+    cell result = r.get_cell();
+    uint32_t nglobals = r.get<uint32_t>();
+    for (uint32_t i = 0; i < nglobals; i++)
+    {
+        symbol *sym = r.get_symbol();
+        cell &value = global_env->get(sym);
+        if (replaced)
+            *replaced = cell(cell(cell(sym), value), *replaced);
+        value = r.get_cell();
+    }
+    return result;
+}
+
+void restore_globals(const cell &replaced)
+{
+    for (const cell *iter = &replaced; iter && iter->car(); iter = iter->cdr())     //newest first, so a global rebound twice ends up as it was before either.
+        global_env->get(iter->car()->car()->sym) = *iter->car()->cdr();
+}
@@ -0,0 +1,28 @@
+#ifndef IMAGE_H_INCLUDED
+#define IMAGE_H_INCLUDED
+
+#include <string>
+
+#include "parser.h"
+
+// Images: the global environment written out to a file, together with
+// everything reachable from it (conses, strings, closures and their frames,
+// analyzed code), so a later run can load it instead of re-reading and
+// re-evaluating the source it came from. Symbols are stored by name and
+// natives by the name they were first bound to, so an image can be loaded
+// by any process built from the same source. Compiled bytecode is not
+// saved; the VM compiles functions again as they are called.
+
+void image_register_natives();          //call once the natives are bound, before any code can rebind them.
+void save_image(const std::string &path);
+void load_image(const std::string &path);       //replaces the global bindings the image has. Errors are thrown as exceptions.
+
+// The same format in memory, for handing a value to another thread's
+// interpreter: everything the value reaches is copied. With with_globals,
+// so is the current value of each global its code refers to, which
+// unpacking binds; otherwise those refer to whatever the receiver has.
+std::string pack_value(const cell &x, bool with_globals = true);
+cell unpack_value(const std::string &data, cell *replaced = 0);     //with replaced, also pushes (symbol . old value) onto it for each global it binds.
+void restore_globals(const cell &replaced);     //puts back the bindings unpack_value replaced.
+
+#endif // IMAGE_H_INCLUDED
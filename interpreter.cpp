@@ -0,0 +1,102 @@
+#include <iostream>
+
+#include "interpreter.h"
+#include "tokenizer.h"
+#include "proc.h"
+#include "heap.h"
+#include "vm.h"
+#include "analyzer.h"
+#include "image.h"
+#include "globals.h"
+#include "profiler.h"
+
+extern thread_local environment *global_env;
+extern thread_local frame *env;
+
+static thread_local interpreter *current = 0;
+static const size_t stack_per_call = 2048;         //C++ stack a tree-walker call takes, with the expressions it's nested in.
+static const size_t min_stack_size = 8 * 1024 * 1024;
+
+static void release()           //back to how the thread started, with nothing on its heap.
+{
+    if (profiling)
+        proc_profile_stop(cell());
+    flush_console();
+    delete global_env;
+    global_env = 0;
+    env = 0;
+    pending_go = 0;
+    eval_depth = 0;
+    gc_shutdown();
+    current = 0;
+}
+
+interpreter::interpreter(const interpreter_options &options)
+{
+    if (current)
+        throw(exception("Error: this thread already has an interpreter."));
+    current = this;
+    use_vm = options.use_vm;
+    eager_macroexpand = options.eager_expand;
+    max_eval_depth = options.max_depth;
+    set_console_policy(options.output);
+    gc_init();
+    setupGlobals();
+    if (options.image.empty())
+    {
+        loadPrelude();
+        return;
+    }
+    try
+    {
+        load_image(options.image);
+    }
+    catch (exception e)
+    {
+        release();
+        throw;
+    }
+}
+
+interpreter::~interpreter()
+{
+    release();
+}
+
+cell interpreter::eval(const cell &form)
+{
+    cell result = use_vm? vm_eval(form) : eval_toplevel(form);
+    if (pending_go)
+    {
+        symbol *tag = pending_go;
+        pending_go = 0;
+        throw(exception("Error: tried to go to unmatched tag \"" + tag->name + "\""));
+    }
+    return result;
+}
+
+bool interpreter::run_script(std::istream &in, const std::string &name)
+{
+    lexer lex(in);
+    parser p(lex);
+    try
+    {
+        while (!p.at_end())
+            eval(p.read());
+    }
+    catch (exception e)
+    {
+        pending_go = 0;
+        flush_console();
+        std::cout.flush();
+        std::cerr << name << ": " << e.err << "\n";
+        return false;
+    }
+    return true;
+}
+
+size_t interpreter_stack_size(const interpreter_options &options)
+{
+    size_t size = (size_t)options.max_depth * stack_per_call + 1024 * 1024;     //and a margin for the evaluator's own callers.
+    return size < min_stack_size? min_stack_size : size;
+}
@@ -0,0 +1,51 @@
+#ifndef INTERPRETER_H_INCLUDED
+#define INTERPRETER_H_INCLUDED
+
+#include <istream>
+#include <string>
+
+#include "parser.h"
+#include "printer.h"
+
+// One evaluator: its heap, global environment, VM stack, profiler and
+// settings. That state lives in thread-local storage, so every thread can
+// run an interpreter of its own at the same time as the others; only the
+// symbol table is shared. An interpreter belongs to the thread that made
+// it, and there can be one per thread at a time. Destroying it frees its
+// heap, so a thread can go on to make another - e.g. one per script served.
+
+struct interpreter_options
+{
+    bool use_vm;            //run top-level forms on the bytecode VM instead of the tree walker
+    bool eager_expand;      //expand macro calls as they're analyzed
+    int max_depth;          //calls before a "maximum evaluation depth" error - if the tree walker doesn't run out of the thread's stack first
+    std::string image;      //load this image instead of the prelude
+    flush_policy output;    //when printing passes text on to cout
+    interpreter_options() : use_vm(false), eager_expand(false), max_depth(100000), output(flush_calls) {}
+};
+
+class interpreter
+{
+    private:
+    bool use_vm;
+    interpreter(const interpreter&);
+    interpreter& operator=(const interpreter&);
+
+    public:
+    interpreter(const interpreter_options &options = interpreter_options());     //throws an exception if the image won't load.
+    ~interpreter();
+    cell eval(const cell &form);        //a top-level form. Throws on an error, including a go with no tagbody to go to.
+    bool run_script(std::istream &in, const std::string &name);        //evaluates every form in turn; false, with a message on cerr, at the first error.
+};
+
+// The tree walker nests calls on the C++ stack, so on the tree walker how
+// deep a program can go is bounded by the stack of the thread it runs on as
+// well as by max_depth, and running out of stack is an error of its own. A
+// thread with interpreter_stack_size bytes of stack has room for max_depth
+// calls of the usual shapes, and the cpplisp command runs its interpreters
+// on threads that size; a default 8 MB stack has room for about 15000.
+// The vm keeps its calls on the heap and is bounded by max_depth alone.
+
+size_t interpreter_stack_size(const interpreter_options &options);
+
+#endif // INTERPRETER_H_INCLUDED
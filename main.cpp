@@ -1,125 +1,221 @@
 #include <iostream>
+#include <fstream>
+#include <cstdlib>
+#include <atomic>
+#include <functional>
+#include <vector>
+
+#include <pthread.h>
 
 #include "tokenizer.h"
 #include "parser.h"
 #include "proc.h"
+#include "printer.h"
+#include "image.h"
+#include "interpreter.h"
 
 
-extern std::shared_ptr<environment> global_env;
-environment *global_env_ptr;
-extern std::shared_ptr<environment> env;
-
-void setupGlobals()
-{
-    global_env_ptr = new environment();
-    global_env = std::shared_ptr<environment>(global_env_ptr);
-    global_env->vars["PRINT"] = proc_print;
-    global_env->vars["WRITE"] = proc_write;
-    global_env->vars["EVAL"] = proc_eval_arglist;   //arglist interface to actual eval function.
-    global_env->vars["+"] = proc_add;
-    global_env->vars["-"] = proc_subtract;
-    global_env->vars["*"] = proc_multiply;
-    global_env->vars["/"] = proc_divide;
-    global_env->vars["="] = proc_equal;
-    global_env->vars["<"] = proc_less;
-    global_env->vars[">"] = proc_greater;
-    global_env->vars["<="] = proc_less_equal;
-    global_env->vars[">="] = proc_greater_equal;
-    global_env->vars["AND"] = proc_and;
-    global_env->vars["OR"] = proc_or;
-    global_env->vars["NOT"] = proc_not;
-    global_env->vars["IF"] = proc_if;
-    global_env->vars["BEGIN"] = proc_begin;
-    global_env->vars["DEFINE"] = proc_define;
-    global_env->vars["QUOTE"] = proc_quote;
-    global_env->vars["QUASI-QUOTE"] = proc_quasi_quote;
-    global_env->vars["LAMBDA"] = proc_lambda;
-    global_env->vars["MACRO"] = proc_macro;
-    global_env->vars["MACROEXPAND-1"] = proc_macroexpand;
-    global_env->vars["LISTVARS"] = proc_listvars;
-    global_env->vars["TAGBODY"] = proc_tagbody;
-    global_env->vars["GO"] = proc_go;
-    global_env->vars["CONS"] = proc_cons;
-    global_env->vars["CAR"] = proc_car;
-    global_env->vars["CDR"] = proc_cdr;
-    global_env->vars["LIST"] = proc_list;
-    global_env->vars["SETQ"] = proc_setq;
-    global_env->vars["NREVERSE"] = proc_nreverse;
-    global_env->vars["LET"] = proc_let;
-    global_env->vars["NIL"] = cell(v_symbol, "NIL");
-    global_env->vars["TRUE"] = cell(v_symbol, "TRUE");
-    env = global_env;
-
-    std::string runOnStart =
-    "(define defmacro (macro (name vars &rest body) `(define ,name (macro ,vars ,@body))))"
-    "(defmacro defun (name vars &rest body) `(define ,name (lambda ,vars ,@body)))"
-    "(defmacro while (expr &rest body) `(tagbody top (if ,expr (begin ,@body (go top))) end))"
-    "(defmacro when (cond &rest body) `(if ,cond (begin ,@body)))"
-    "(defmacro unless (cond &rest body) `(if (not ,cond) (begin ,@body)))"
-    "(defmacro mapcar (func list) `(let ((acc '()) (lis ,list) (fun ,func))"
-    " (tagbody top"
-    "  (when (cdr lis)"
-    "        (push acc (fun (car lis)))"
-    "        (setq lis (cdr lis))"
-    "        (go top))"
-    "  (nreverse acc))))"
-    "(defmacro push (list arg) `(setq ,list (cons ,arg ,list)))";
-    parser p(tokenize(runOnStart));
-    try
-    {
-        while (true)
-            proc_eval(p.read());
-    }
-    catch (exception e) {}
-}
-
-int countBrackets(std::vector<token> tokens)
+int countBrackets(std::string_view line)
 {
     int count = 0;
-    std::vector<token>::iterator iter = tokens.begin();
-    for(; iter != tokens.end(); iter++)
+    lexer lex(line);
+    token t;
+    while (lex.next(t))
     {
-        if (iter->type == t_lparen)
+        if (t.type == t_lparen)
             count++;
-        else if (iter->type == t_rparen)
+        else if (t.type == t_rparen)
             count--;
     }
     return count;
 }
 
 
-int main()
+static void repl(interpreter &lisp)
 {
-    setupGlobals();
+    std::string line;
     while (true)
     {
-        char progstring[5000];
         std::cout << "> ";
-        std::cin.getline(progstring, 5000, '\n');
-        std::vector<token> tokens = tokenize(progstring);
-        while (countBrackets(tokens) > 0)
+        if (!std::getline(std::cin, line))
+            return;
+        std::string text = line;
+        int depth = countBrackets(text);
+        while (depth > 0)
         {
             std::cout << ">> ";          //we are expecting more input!
-            std::cin.getline(progstring, 5000, '\n');
-            std::vector<token> extratokens = tokenize(progstring);
-            tokens.reserve(tokens.size() + extratokens.size());
-            tokens.insert(tokens.end(), extratokens.begin(), extratokens.end());
+            if (!std::getline(std::cin, line))
+                return;
+            depth += countBrackets(line);
+            text += "\n";
+            text += line;
         }
-        parser p(tokens);
+        lexer lex(text);
+        parser p(lex);
         try
         {
-            cell expr = p.read();
-            cell result = proc_eval(expr);
+            cell result = lisp.eval(p.read());
+            flush_console();
             std::cout << "==> " << toString(result) << "\n\n";
         }
         catch (exception e)
         {
+            pending_go = 0;
+            flush_console();
             std::cout << e.err << "\n";
         }
-        catch (tag_sym t)
+    }
+}
+
+static bool run_file(interpreter &lisp, const std::string &name)
+{
+    if (name == "-")
+        return lisp.run_script(std::cin, "<stdin>");
+    std::ifstream file(name.c_str(), std::ios::binary);
+    if (!file)
+    {
+        std::cerr << name << ": cannot open file\n";
+        return false;
+    }
+    return lisp.run_script(file, name);
+}
+
+static void* run_work(void *work)
+{
+    (*(std::function<void()>*)work)();
+    return 0;
+}
+
+static bool start_thread(pthread_t &thread, size_t stack_size, std::function<void()> &work)     //a thread with a stack big enough for the tree walker to reach the depth limit.
+{
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, stack_size);
+    bool started = pthread_create(&thread, &attr, run_work, &work) == 0;
+    pthread_attr_destroy(&attr);
+    return started;
+}
+
+static void run_with_stack(size_t stack_size, std::function<void()> work)
+{
+    pthread_t thread;
+    if (start_thread(thread, stack_size, work))
+        pthread_join(thread, 0);
+    else
+        work();                 //no room for that much stack: run here, and run out sooner.
+}
+
+static bool run_parallel(const std::vector<std::string> &scripts, const interpreter_options &options, int jobs)    //each script in a fresh interpreter, on one of jobs threads.
+{
+    std::atomic<size_t> next(0);
+    std::atomic<bool> ok(true);
+    std::function<void()> work = [&]()
+    {
+        for (size_t j; (j = next++) < scripts.size();)
+        {
+            try
+            {
+                interpreter lisp(options);
+                if (!run_file(lisp, scripts[j]))
+                    ok = false;
+            }
+            catch (exception e)
+            {
+                std::cerr << options.image << ": " << e.err << "\n";
+                ok = false;
+            }
+        }
+    };
+    std::vector<pthread_t> workers;
+    for (int i = 0; i < jobs; i++)
+    {
+        pthread_t thread;
+        if (start_thread(thread, interpreter_stack_size(options), work))
+            workers.push_back(thread);
+    }
+    if (workers.empty())
+        work();
+    for (size_t i = 0; i < workers.size(); i++)
+        pthread_join(workers[i], 0);
+    return ok;
+}
+
+static int run(const interpreter_options &options, const std::vector<std::string> &scripts, const std::string &image_out)
+{
+    try
+    {
+        interpreter lisp(options);
+        if (scripts.empty() && image_out.empty())
+        {
+            repl(lisp);
+            return 0;
+        }
+        for (size_t i = 0; i < scripts.size(); i++)
+            if (!run_file(lisp, scripts[i]))
+                return 1;
+        if (!image_out.empty())
         {
-            std::cout << "Error: tried to go to unmatched tag \"" << t.str << "\"\n";
+            try
+            {
+                save_image(image_out);
+            }
+            catch (exception e)
+            {
+                std::cerr << image_out << ": " << e.err << "\n";
+                return 1;
+            }
         }
     }
+    catch (exception e)
+    {
+        std::cerr << options.image << ": " << e.err << "\n";
+        return 1;
+    }
     return 0;
 }
+
+int main(int argc, char **argv)
+{
+    interpreter_options options;
+    std::vector<std::string> scripts;       //run in order instead of the REPL; "-" is standard input.
+    std::string image_out;                  //--image replaces the prelude; --save-image writes the environment after the scripts, instead of the REPL.
+    int jobs = 0;                           //--jobs runs the scripts concurrently instead, each in an interpreter of its own.
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--vm")
+            options.use_vm = true;          //run top-level forms on the bytecode VM instead of the tree walker.
+        else if (arg == "--eager-expand")
+            options.eager_expand = true;
+        else if (arg == "--buffer-output")
+            options.output = flush_when_full;       //printing reaches cout a block at a time rather than once a call.
+        else if (arg == "--max-depth" && i + 1 < argc && atoi(argv[i + 1]) > 0)
+            options.max_depth = atoi(argv[++i]);
+        else if (arg == "--image" && i + 1 < argc)
+            options.image = argv[++i];
+        else if (arg == "--save-image" && i + 1 < argc)
+            image_out = argv[++i];
+        else if (arg == "--jobs" && i + 1 < argc && atoi(argv[i + 1]) > 0)
+            jobs = atoi(argv[++i]);
+        else if (arg == "-" || arg.compare(0, 2, "--") != 0)
+            scripts.push_back(arg);
+        else
+        {
+            std::cerr << "usage: " << argv[0] << " [--vm] [--eager-expand] [--buffer-output] [--max-depth calls] [--image file] [--save-image file | --jobs threads] [script.lisp | -] ...\n";
+            return 1;
+        }
+    }
+    if (jobs)
+    {
+        if (!image_out.empty() || scripts.empty())
+        {
+            std::cerr << argv[0] << ": --jobs needs scripts to run, and can't be used with --save-image\n";
+            return 1;
+        }
+        return run_parallel(scripts, options, jobs)? 0 : 1;     //cout stays synchronised with stdio, which makes it safe to share between the threads.
+    }
+    std::ios::sync_with_stdio(false);
+    int status = 1;
+    run_with_stack(interpreter_stack_size(options), [&]() {status = run(options, scripts, image_out);});
+    return status;
+}
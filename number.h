@@ -0,0 +1,90 @@
+#ifndef NUMBER_H_INCLUDED
+#define NUMBER_H_INCLUDED
+
+#include <climits>
+
+#include "parser.h"
+
+// The numeric tower: fixnums (exact 64-bit integers, held in the cell) and
+// doubles. Arithmetic on two fixnums stays exact unless it overflows, in
+// which case it is redone in doubles; anything involving a double is a
+// double. Division gives a fixnum only when it comes out exact.
+// Shared by the tree walker's procs and the VM's inline natives.
+
+inline double number_value(const cell &x)
+{
+    if (x.type == v_fixnum)
+        return (double)x.i;
+    if (x.type != v_number)
+        throw(exception("Error: expected number as argument to arithmetic."));
+    return x.n;
+}
+
+#if defined(__GNUC__)
+inline bool fixnum_add(long long a, long long b, long long *result) {return !__builtin_add_overflow(a, b, result);}
+inline bool fixnum_subtract(long long a, long long b, long long *result) {return !__builtin_sub_overflow(a, b, result);}
+inline bool fixnum_multiply(long long a, long long b, long long *result) {return !__builtin_mul_overflow(a, b, result);}
+#else
+inline bool fixnum_add(long long a, long long b, long long *result)
+{
+    if ((b > 0 && a > LLONG_MAX - b) || (b < 0 && a < LLONG_MIN - b))
+        return false;
+    *result = a + b;
+    return true;
+}
+inline bool fixnum_subtract(long long a, long long b, long long *result)
+{
+    if ((b < 0 && a > LLONG_MAX + b) || (b > 0 && a < LLONG_MIN + b))
+        return false;
+    *result = a - b;
+    return true;
+}
+inline bool fixnum_multiply(long long a, long long b, long long *result)      //only small enough factors - the rest go to doubles.
+{
+    if (a < -INT_MAX || a > INT_MAX || b < -INT_MAX || b > INT_MAX)
+        return false;
+    *result = a * b;
+    return true;
+}
+#endif
+
+inline cell number_add(const cell &a, const cell &b)
+{
+    long long result;
+    if (a.type == v_fixnum && b.type == v_fixnum && fixnum_add(a.i, b.i, &result))
+        return cell(result);
+    return cell(number_value(a) + number_value(b));
+}
+
+inline cell number_subtract(const cell &a, const cell &b)
+{
+    long long result;
+    if (a.type == v_fixnum && b.type == v_fixnum && fixnum_subtract(a.i, b.i, &result))
+        return cell(result);
+    return cell(number_value(a) - number_value(b));
+}
+
+inline cell number_multiply(const cell &a, const cell &b)
+{
+    long long result;
+    if (a.type == v_fixnum && b.type == v_fixnum && fixnum_multiply(a.i, b.i, &result))
+        return cell(result);
+    return cell(number_value(a) * number_value(b));
+}
+
+inline cell number_divide(const cell &a, const cell &b)
+{
+    if (a.type == v_fixnum && b.type == v_fixnum && b.i != 0 && !(a.i == LLONG_MIN && b.i == -1) && a.i % b.i == 0)
+        return cell(a.i / b.i);
+    return cell(number_value(a) / number_value(b));
+}
+
+inline int number_compare(const cell &a, const cell &b)       //-1, 0 or 1, as for a - b.
+{
+    if (a.type == v_fixnum && b.type == v_fixnum)
+        return a.i < b.i? -1 : a.i > b.i? 1 : 0;
+    double x = number_value(a), y = number_value(b);
+    return x < y? -1 : x > y? 1 : 0;
+}
+
+#endif // NUMBER_H_INCLUDED
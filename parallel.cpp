@@ -0,0 +1,502 @@
+#include <atomic>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "parallel.h"
+#include "proc.h"
+#include "heap.h"
+#include "image.h"
+#include "interpreter.h"
+#include "vector.h"
+
+enum job_kind {job_map, job_reduce, job_call};
+
+enum task_state {task_queued, task_running, task_done};
+
+struct parallel_task        //a run of a job's items, and what came of them.
+{
+    std::atomic<int> state;         //queued until someone claims it
+    size_t first, count;
+    bool remote;                    //run by a worker, so its results are packed in output
+    std::string input;              //the items, packed as a list
+    std::string output;             //a list of results for a map, or the one value
+    std::string error;
+    parallel_task() : state(task_queued), first(0), count(0), remote(false) {}
+};
+
+struct parallel_job
+{
+    job_kind kind;
+    unsigned long long id;          //workers keep the function they last unpacked, by job
+    std::string program;            //the function, packed
+    std::vector<parallel_task> tasks;
+    std::mutex lock;
+    std::condition_variable finished;
+    size_t remaining;
+    parallel_job(job_kind kind_, size_t ntasks);
+    bool claim(size_t i);
+    void done(size_t i);
+    void wait();
+};
+
+parallel_job::parallel_job(job_kind kind_, size_t ntasks) : kind(kind_), tasks(ntasks), remaining(ntasks)
+{
+    static std::atomic<unsigned long long> next_id(1);
+    id = next_id++;
+}
+
+bool parallel_job::claim(size_t i)
+{
+    int expected = task_queued;
+    return tasks[i].state.compare_exchange_strong(expected, task_running);
+}
+
+void parallel_job::done(size_t i)
+{
+    std::lock_guard<std::mutex> hold(lock);
+    tasks[i].state = task_done;
+    if (--remaining == 0)
+        finished.notify_all();
+}
+
+void parallel_job::wait()
+{
+    std::unique_lock<std::mutex> hold(lock);
+    finished.wait(hold, [this]() {return remaining == 0;});
+}
+
+
+// The pool. Each worker has a deque of tasks, which callers add to in turn;
+// it works from the back of its own and steals from the front of the
+// others'. A task is only run by whoever claims it, so one the caller has
+// already started (see run_job) is just dropped when it comes off a deque.
+
+struct task_ref
+{
+    std::shared_ptr<parallel_job> job;
+    size_t task;
+};
+
+struct work_queue
+{
+    std::mutex lock;
+    std::deque<task_ref> tasks;
+};
+
+static void run_remote(parallel_job &job, size_t i, cell &fn, unsigned long long &fn_job, cell &replaced);
+
+class thread_pool
+{
+    private:
+    std::vector<std::thread> threads;
+    std::vector<work_queue> queues;
+    std::mutex idle_lock;
+    std::condition_variable wake;
+    std::atomic<size_t> queued;     //tasks on the deques; only ever added to under idle_lock
+    size_t next_queue;
+    bool stopping;
+    bool take(size_t self, task_ref &t);
+    void work(size_t self);
+
+    public:
+    thread_pool(size_t workers);
+    ~thread_pool();
+    size_t size() const {return threads.size();}
+    void submit(const std::shared_ptr<parallel_job> &job, size_t task);
+};
+
+thread_pool::thread_pool(size_t workers) : queues(workers), queued(0), next_queue(0), stopping(false)
+{
+    for (size_t i = 0; i < workers; i++)
+        threads.push_back(std::thread(&thread_pool::work, this, i));
+}
+
+thread_pool::~thread_pool()
+{
+    {
+        std::lock_guard<std::mutex> hold(idle_lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (size_t i = 0; i < threads.size(); i++)
+        threads[i].join();
+}
+
+void thread_pool::submit(const std::shared_ptr<parallel_job> &job, size_t task)
+{
+    {
+        std::lock_guard<std::mutex> hold(idle_lock);
+        work_queue &q = queues[next_queue];
+        next_queue = (next_queue + 1) % queues.size();
+        std::lock_guard<std::mutex> hold_queue(q.lock);
+        task_ref t = {job, task};
+        q.tasks.push_back(t);
+        queued++;
+    }
+    wake.notify_one();
+}
+
+bool thread_pool::take(size_t self, task_ref &t)
+{
+    for (size_t n = 0; n < queues.size(); n++)
+    {
+        work_queue &q = queues[(self + n) % queues.size()];
+        std::lock_guard<std::mutex> hold(q.lock);
+        if (q.tasks.empty())
+            continue;
+        if (n == 0)
+        {
+            t = q.tasks.back();
+            q.tasks.pop_back();
+        }
+        else
+        {
+            t = q.tasks.front();
+            q.tasks.pop_front();
+        }
+        queued--;
+        return true;
+    }
+    return false;
+}
+
+void thread_pool::work(size_t self)
+{
+    interpreter lisp;
+    cell fn;                        //on this thread's stack, so its own collector keeps it
+    unsigned long long fn_job = 0;
+    cell replaced(v_list);          //the bindings fn_job's globals replaced, to put back before the next job
+    while (true)
+    {
+        task_ref t;
+        if (take(self, t))
+        {
+            if (t.job->claim(t.task))
+                run_remote(*t.job, t.task, fn, fn_job, replaced);
+            continue;
+        }
+        std::unique_lock<std::mutex> hold(idle_lock);
+        wake.wait(hold, [this]() {return stopping || queued > 0;});
+        if (stopping)
+            return;
+    }
+}
+
+static size_t worker_count()
+{
+    const char *setting = std::getenv("CPPLISP_WORKERS");
+    if (setting)
+        return std::strtoul(setting, 0, 10);
+    unsigned cores = std::thread::hardware_concurrency();
+    return cores > 1? cores - 1 : 0;
+}
+
+static thread_pool& pool()          //started the first time anything is run in parallel.
+{
+    static thread_pool p(worker_count());
+    return p;
+}
+
+
+// Running tasks. On a worker the function and items are unpacked into its
+// own heap first; in the caller they're used as they are.
+
+static cell reduce_items(const cell &fn, const cell *items, size_t n)
+{
+    cell acc = items[0];
+    for (size_t i = 1; i < n; i++)
+    {
+        cell args[2] = {acc, items[i]};
+        acc = apply_function(fn, args, 2);
+        if (pending_go)
+            break;
+    }
+    return acc;
+}
+
+static void check_go()
+{
+    if (!pending_go)
+        return;
+    pending_go = 0;
+    throw(exception("Error: tried to go out of a parallel task."));
+}
+
+static void run_remote(parallel_job &job, size_t i, cell &fn, unsigned long long &fn_job, cell &replaced)
+{
+    parallel_task &task = job.tasks[i];
+    task.remote = true;
+    try
+    {
+        if (fn_job != job.id)
+        {
+            fn = cell();
+            fn_job = 0;
+            restore_globals(replaced);          //so one job's globals don't outlast it on this worker.
+            replaced = cell(v_list);
+            fn = unpack_value(job.program, &replaced);
+            fn_job = job.id;
+        }
+        cell result;
+        if (job.kind == job_call)
+            result = apply_function(fn, 0, 0);
+        else
+        {
+            cell items(v_vector);
+            items.vec = make_vector(task.count);
+            cell list = unpack_value(task.input, &replaced);
+            for (size_t k = 0; k < task.count; k++, list = *list.cdr())
+                items.vec->items[k] = *list.car();
+            if (job.kind == job_reduce)
+                result = reduce_items(fn, items.vec->items, task.count);
+            else
+            {
+                for (size_t k = 0; k < task.count && !pending_go; k++)
+                    items.vec->items[k] = apply_function(fn, &items.vec->items[k], 1);
+                result = cell(v_list);
+                for (size_t k = task.count; k-- > 0;)
+                    result = cell(items.vec->items[k], result);
+            }
+        }
+        check_go();
+        task.output = pack_value(result, false);
+    }
+    catch (exception e)
+    {
+        task.error = e.err;
+    }
+    job.done(i);
+}
+
+static void run_local(parallel_job &job, size_t i, const cell &fn, const cell &items, const cell &results)
+{
+    parallel_task &task = job.tasks[i];
+    try
+    {
+        if (job.kind == job_reduce)
+            results.vec->items[i] = reduce_items(fn, &items.vec->items[task.first], task.count);
+        else
+        {
+            for (size_t k = task.first; k < task.first + task.count; k++)
+            {
+                cell value = apply_function(fn, &items.vec->items[k], 1);
+                if (pending_go)
+                    break;
+                results.vec->items[k] = value;
+            }
+        }
+        check_go();
+    }
+    catch (exception e)
+    {
+        task.error = e.err;
+    }
+    job.done(i);
+}
+
+static void abandon(parallel_job &job)         //so a job that has failed isn't run any further.
+{
+    for (size_t i = 0; i < job.tasks.size(); i++)
+        if (job.claim(i))
+            job.done(i);
+}
+
+static cell run_job(job_kind kind, const cell &fn, const cell &items)     //results has one value per item for a map, or one per task for a reduce.
+{
+    size_t n = items.vec->length;
+    size_t workers = pool().size();
+    size_t ntasks = std::min(n, 4 * (workers + 1));
+    std::shared_ptr<parallel_job> job(new parallel_job(kind, ntasks));
+    cell results(v_vector);
+    results.vec = make_vector(kind == job_map? n : ntasks);
+    for (size_t i = 0, first = 0; i < ntasks; i++)
+    {
+        parallel_task &task = job->tasks[i];
+        task.first = first;
+        task.count = n / ntasks + (i < n % ntasks);
+        first += task.count;
+    }
+    if (workers)            //the caller keeps the first task, so it's never packed.
+    {
+        job->program = pack_value(fn);
+        for (size_t i = 1; i < ntasks; i++)
+        {
+            parallel_task &task = job->tasks[i];
+            cell chunk(v_list);
+            for (size_t k = task.first + task.count; k-- > task.first;)
+                chunk = cell(items.vec->items[k], chunk);
+            task.input = pack_value(chunk);
+            pool().submit(job, i);
+        }
+    }
+    for (size_t i = 0; i < ntasks; i++)
+    {
+        if (!job->claim(i))
+            continue;
+        run_local(*job, i, fn, items, results);
+        if (!job->tasks[i].error.empty())
+        {
+            abandon(*job);
+            break;
+        }
+    }
+    job->wait();
+    for (size_t i = 0; i < ntasks; i++)
+    {
+        parallel_task &task = job->tasks[i];
+        if (!task.error.empty())
+            throw(exception(task.error));
+        if (!task.remote)
+            continue;
+        cell value = unpack_value(task.output);
+        if (kind == job_reduce)
+            results.vec->items[i] = value;
+        else
+            for (size_t k = task.first; k < task.first + task.count; k++, value = *value.cdr())
+                results.vec->items[k] = *value.car();
+    }
+    return results;
+}
+
+static cell to_items(const cell &seq, const std::string &name)       //the items of a list or vector, as a vector.
+{
+    if (seq.type == v_vector)
+        return seq;
+    cell items(v_vector);
+    if (seq.type == v_double_vector)
+    {
+        items.vec = make_vector(seq.dvec->length);
+        for (size_t i = 0; i < seq.dvec->length; i++)
+            items.vec->items[i] = cell(seq.dvec->items[i]);
+        return items;
+    }
+    if (!(seq == cell()) && seq.type != v_list)
+        throw(exception("Error: expected list or vector as argument to " + name + "."));
+    size_t n = 0;
+    for (const cell *iter = &seq; iter->type == v_list && iter->car(); iter = iter->cdr())
+        n++;
+    items.vec = make_vector(n);
+    n = 0;
+    for (const cell *iter = &seq; iter->type == v_list && iter->car(); iter = iter->cdr())
+        items.vec->items[n++] = *iter->car();
+    return items;
+}
+
+static void check_function(const cell &fn, const std::string &name)
+{
+    if (fn.type != v_function && fn.type != v_primitive)       //not a proc: those are special forms, or want their arguments unevaluated.
+        throw(exception("Error: expected function as first argument to " + name + "."));
+}
+
+
+// From Lisp.
+
+cell proc_pmapcar(const cell &arglist)         //(pmapcar fn seq): mapcar, with the items spread over the pool.
+{
+    cell args[2];
+    if (!eval_args(arglist, args, 2))
+        return cell();
+    check_function(args[0], "pmapcar");
+    cell items = to_items(args[1], "pmapcar");
+    if (!items.vec->length)
+        return args[1].type == v_list? cell(v_list) : items;
+    cell results = run_job(job_map, args[0], items);
+    if (args[1].type == v_vector || args[1].type == v_double_vector)
+        return results;
+    cell list(v_list);
+    for (size_t i = results.vec->length; i-- > 0;)
+        list = cell(results.vec->items[i], list);
+    return list;
+}
+
+cell proc_preduce(const cell &arglist)         //(preduce fn seq [initial]): reduce, which needs fn to be associative, as the items are reduced in runs that are then combined in order.
+{
+    cell args[3];
+    if (!eval_args(arglist, args, 3))
+        return cell();
+    check_function(args[0], "preduce");
+    bool has_initial = arglist.cdr() && arglist.cdr()->cdr() && arglist.cdr()->cdr()->car();
+    cell items = to_items(args[1], "preduce");
+    if (!items.vec->length)
+        return has_initial? args[2] : apply_function(args[0], 0, 0);
+    cell partial = run_job(job_reduce, args[0], items);
+    if (!has_initial)
+        return reduce_items(args[0], partial.vec->items, partial.vec->length);
+    cell operands[2] = {args[2]};
+    for (size_t i = 0; i < partial.vec->length; i++)
+    {
+        operands[1] = partial.vec->items[i];
+        operands[0] = apply_function(args[0], operands, 2);
+        if (pending_go)
+            return cell();
+    }
+    return operands[0];
+}
+
+cell proc_spawn(const cell &arglist)           //(spawn fn): a future for the value of (fn), which a worker starts on when it's free.
+{
+    cell fn;
+    if (!eval_args(arglist, &fn, 1))
+        return cell();
+    check_function(fn, "spawn");
+    cell result(v_future);
+    result.fut = make_future(fn);
+    if (pool().size())
+    {
+        std::shared_ptr<parallel_job> job(new parallel_job(job_call, 1));
+        job->program = pack_value(fn);
+        result.fut->job = job;
+        pool().submit(job, 0);
+    }
+    return result;
+}
+
+cell proc_touch(const cell &arglist)           //(touch x): the value of a future, waiting for it if need be. Anything else is its own value.
+{
+    cell x;
+    if (!eval_args(arglist, &x, 1))
+        return cell();
+    if (x.type != v_future)
+        return x;
+    future *f = x.fut;
+    if (f->ready)
+        return f->value;
+    std::shared_ptr<parallel_job> job = f->job;
+    cell value;
+    if (!job || job->claim(0))          //nobody has started it, so run it here.
+    {
+        try
+        {
+            value = apply_function(f->thunk, 0, 0);
+            check_go();
+        }
+        catch (exception e)
+        {
+            if (job)
+            {
+                job->tasks[0].error = e.err;
+                job->done(0);
+            }
+            throw;
+        }
+        if (job)
+            job->done(0);
+    }
+    else
+    {
+        job->wait();
+        if (!job->tasks[0].error.empty())
+            throw(exception(job->tasks[0].error));
+        value = unpack_value(job->tasks[0].output);
+    }
+    f->value = value;
+    f->ready = true;
+    f->thunk = cell();
+    f->job.reset();
+    return value;
+}
@@ -0,0 +1,37 @@
+#ifndef PARALLEL_H_INCLUDED
+#define PARALLEL_H_INCLUDED
+
+#include <memory>
+
+#include "parser.h"
+
+// Data parallelism on a pool of worker threads, each running an
+// interpreter of its own, so no thread ever touches another's heap. Work
+// goes to a worker packed as in an image (pack_value): the function with
+// the globals its code refers to, and a chunk of the items. The results
+// come back the same way. Chunks sit on per-worker deques; an idle worker
+// takes from the back of its own and steals from the front of the others'.
+// A caller waiting on its chunks runs any nobody has started yet, straight
+// on its own heap. The functions should be pure: one running on a worker
+// sees copies, so changes it makes to them are lost. The globals a job
+// brings are bound on the worker only until it starts on another job.
+// The function must be a lambda or a primitive, not a special form.
+// CPPLISP_WORKERS sets the size of the pool; by default it's one fewer
+// than the number of cores, and with none everything runs in the caller.
+
+struct parallel_job;
+
+struct future               //on the collected heap.
+{
+    cell thunk;             //the function to call, until it has been
+    cell value;
+    bool ready;
+    std::shared_ptr<parallel_job> job;      //null if the pool has no workers
+};
+
+cell proc_pmapcar(const cell &arglist);
+cell proc_preduce(const cell &arglist);
+cell proc_spawn(const cell &arglist);
+cell proc_touch(const cell &arglist);
+
+#endif // PARALLEL_H_INCLUDED
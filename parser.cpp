@@ -1,6 +1,11 @@
 #include <stdlib.h>
+#include <climits>
+#include <mutex>
+#include <unordered_map>
 
 #include "parser.h"
+#include "heap.h"
+#include "vector.h"
 
 std::string toUpper(std::string str)
 {
@@ -17,11 +22,55 @@ std::string toUpper(std::string str)
     return str;
 }
 
+symbol sym_nil("NIL");                  //statically allocated so their addresses are usable before the symbol table exists.
+symbol sym_true("TRUE");
+symbol sym_quote("QUOTE");
+symbol sym_quasi_quote("QUASI-QUOTE");
+symbol sym_un_quote("UN-QUOTE");
+symbol sym_splice_un_quote("SPLICE-UN-QUOTE");
+symbol sym_rest("&REST");
+
+static std::unordered_map<std::string, symbol*>& symbol_table()
+{
+    static std::unordered_map<std::string, symbol*> table;
+    if (table.empty())
+    {
+        table["NIL"] = &sym_nil;
+        table["TRUE"] = &sym_true;
+        table["QUOTE"] = &sym_quote;
+        table["QUASI-QUOTE"] = &sym_quasi_quote;
+        table["UN-QUOTE"] = &sym_un_quote;
+        table["SPLICE-UN-QUOTE"] = &sym_splice_un_quote;
+        table["&REST"] = &sym_rest;
+    }
+    return table;
+}
+
+symbol* intern(const std::string &name)      //the one table is shared by every interpreter in the process, so symbols can be too.
+{
+    static std::mutex lock;
+    std::lock_guard<std::mutex> hold(lock);
+    std::unordered_map<std::string, symbol*> &table = symbol_table();
+    std::unordered_map<std::string, symbol*>::iterator iter = table.find(name);
+    if (iter != table.end())
+        return iter->second;
+    symbol *sym = new symbol(name);                 //symbols are never collected - there are only as many as distinct names read.
+    table[name] = sym;
+    return sym;
+}
+
+static std::string* empty_string()
+{
+    static std::string str;
+    return &str;
+}
+
 cell::cell()
 {
     type = v_symbol;
-    str = "NIL";
+    sym = &sym_nil;
 }
+
 cell::cell(cell_type type_)
 {
     type = type_;
@@ -30,89 +79,156 @@ cell::cell(cell_type type_)
         case v_number:
             n = 0;
             break;
-        case v_list:
-            car = 0;
-            cdr = 0;
+        case v_fixnum:
+            i = 0;
             break;
         case v_proc:
             proc = 0;
             break;
+        case v_symbol:
+            sym = &sym_nil;
+            break;
+        case v_string:
+            str = empty_string();
+            break;
         default:
+            pair = 0;           //empty list, or a function/macro with no closure yet
             break;
     }
 }
 
-cell::cell(cell_type type_, std::string value_)
+cell::cell(cell_type type_, const std::string &value_)
+{
+    type = type_;
+    if (type == v_symbol)
+        sym = intern(value_);
+    else
+        str = make_string(value_);
+}
+
+cell::cell(cell_type type_, std::string *value_)
 {
     type = type_;
     str = value_;
 }
 
+cell::cell(symbol *sym_)
+{
+    type = v_symbol;
+    sym = sym_;
+}
+
 cell::cell(double n_)
 {
     type = v_number;
     n = n_;
 }
 
+cell::cell(long long i_)
+{
+    type = v_fixnum;
+    i = i_;
+}
+
 cell::cell(proc_t proc_)
 {
     type = v_proc;
     proc = proc_;
 }
 
-cell::cell(cell* car_, cell* cdr_)
+cell::cell(const primitive *prim_)
 {
-    type = v_list;
-    car = car_;
-    cdr = cdr_;
+    type = v_primitive;
+    prim = prim_;
+}
+
+cell::cell(const cell &car_, const cell &cdr_)
+{
+    *this = make_cons(car_, cdr_);
 }
 
 bool cell::operator==(const cell &c) const
 {
     if (type != c.type)
+    {
+        if ((type == v_fixnum && c.type == v_number) || (type == v_number && c.type == v_fixnum))
+            return (type == v_fixnum? (double)i : n) == (c.type == v_fixnum? (double)c.i : c.n);
         return false;
+    }
     switch(type)
     {
         case v_symbol:
+            return sym == c.sym;
         case v_string:
-            return str == c.str;
+            return str == c.str || *str == *c.str;
         case v_number:
             return n == c.n;
+        case v_fixnum:
+            return i == c.i;
         case v_list:
-            return car == c.car && cdr == c.cdr;            //pointer comparison only - shallow comparison.
+            return pair == c.pair;            //pointer comparison only - shallow comparison.
+        case v_hash:
+            return hash == c.hash;
+        case v_vector:
+            return vec == c.vec;
+        case v_double_vector:
+            return dvec == c.dvec;
+        case v_future:
+            return fut == c.fut;
+        case v_string_builder:
+            return str == c.str;
         default:
             return false;
     }
 }
 
 
-cell& environment::get(std::string name)
+environment::environment()
 {
-    std::map<std::string, cell>::iterator iter = vars.find(name);
-    if (iter != vars.end())
-        return iter->second;
-    if (parent)
-        return parent->get(name);
-    return vars[name];
+    gc_register_env(this);
+}
+
+environment::~environment()
+{
+    gc_unregister_env(this);
+}
+
+binding* environment::lookup(symbol *name)
+{
+    binding &b = vars[name];                //std::map never moves its nodes, so this pointer stays good.
+    b.name = name;
+    return &b;
+}
+
+cell& environment::get(symbol *name)
+{
+    return lookup(name)->value;
 }
 
 
-parser::parser(std::vector<token> tokens_)
+parser::parser(lexer &lex_) : lex(lex_)
 {
-    tokens = tokens_;
-    ntokens = tokens.size();
-    if (ntokens > 0)
-        t = tokens[0];
-    index = 0;
+    peeked = false;
+}
+
+bool parser::more()                 //fetch the next token if we haven't already; false at the end of the input.
+{
+    if (!peeked)
+        peeked = lex.next(t);
+    return peeked;
+}
+
+bool parser::at_end()
+{
+    return !more();
 }
 
 bool parser::accept(token_type type)
 {
-    if (index < ntokens && t.type == type)
+    if (more() && t.type == type)
     {
         last = t;
-        if (++index < ntokens)
-            t = tokens[index];
+        peeked = false;             //don't fetch the one after yet - the stream may not have it, and last.value is only good until we do.
         return true;
     }
     return false;
@@ -135,39 +251,61 @@ cell parser::read()
 {
     if (accept(t_quote))
     {
-        std::string quoteType = last.value;
-        cell *car = new cell();
-        *car = read();
+        std::string quoteType(last.value);
+        cell quoted(read(), cell(v_list));
         if (quoteType == "'")
-            return cell(new cell(v_symbol, "QUOTE"), new cell(car, (cell*)0));
+            return cell(cell(&sym_quote), quoted);
         else if (quoteType == "`")
-            return cell(new cell(v_symbol, "QUASI-QUOTE"), new cell(car, (cell*)0));
+            return cell(cell(&sym_quasi_quote), quoted);
         else if (quoteType == ",")
-            return cell(new cell(v_symbol, "UN-QUOTE"), new cell(car, (cell*)0));
+            return cell(cell(&sym_un_quote), quoted);
         else if (quoteType == ",@")
-            return cell(new cell(v_symbol, "SPLICE-UN-QUOTE"), new cell(car, (cell*)0));
+            return cell(cell(&sym_splice_un_quote), quoted);
         throw(exception("Error: unknown quote type!"));
     }
     else if (accept(t_string))
-        return cell(v_string, last.value);
+        return cell(v_string, std::string(last.value));
     else if (accept(t_symbol))
-        return cell(v_symbol, toUpper(last.value));
+        return cell(intern(toUpper(std::string(last.value))));
     else if (accept(t_number))
-        return cell(atof(last.value.c_str()));
-    else if (accept(t_lparen))
     {
-        cell head(v_list);
-        cell *tail = &head;
-        while (index < ntokens && t.type != t_rparen)
+        long long value = 0;
+        for (size_t i = 0; i < last.value.size(); i++)
         {
-            cell newcar = read();
-            tail->car = new cell();
-            *tail->car = newcar;
-            tail->cdr = new cell(v_list);
-            tail = tail->cdr;
+            int digit = last.value[i] - '0';
+            if (value > (LLONG_MAX - digit) / 10)
+                return cell(atof(std::string(last.value).c_str()));        //too big for a fixnum.
+            value = value * 10 + digit;
         }
-        expect(t_rparen);
-        return head;
+        return cell(value);
     }
+    else if (accept(t_vector))
+    {
+        cell items = read_list();
+        cell result(v_vector);
+        size_t n = 0;
+        for (const cell *iter = &items; iter->car(); iter = iter->cdr())
+            n++;
+        result.vec = make_vector(n);
+        n = 0;
+        for (const cell *iter = &items; iter->car(); iter = iter->cdr())
+            result.vec->items[n++] = *iter->car();
+        return result;
+    }
+    else if (accept(t_lparen))
+        return read_list();
     throw (exception("Nothing to read."));
 }
+
+cell parser::read_list()            //the rest of a list whose opening bracket has been read.
+{
+    cell head(v_list);
+    cell *tail = &head;
+    while (more() && t.type != t_rparen)
+    {
+        *tail = cell(read(), cell(v_list));
+        tail = tail->cdr();
+    }
+    expect(t_rparen);
+    return head;
+}
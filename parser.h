@@ -13,65 +13,173 @@ std::string toUpper(std::string);
 typedef enum
 {
     v_symbol = 0,
-    v_number,
+    v_number,               //a double
+    v_fixnum,               //an exact integer
     v_string,
     v_function,
     v_proc,
     v_list,
-    v_macro
+    v_macro,
+    v_local,                //resolved variable references, only ever produced by the analyzer
+    v_global,
+    v_hash,
+    v_vector,
+    v_double_vector,
+    v_future,
+    v_primitive,            //a native that's handed its arguments evaluated
+    v_string_builder
 } cell_type;
 
 struct environment;
+struct cons;
+struct closure;
+struct binding;
+struct bytecode;
+struct hash_table;
+struct cell_vector;
+struct double_vector;
+struct future;
+struct primitive;
+
+struct symbol               //interned: one per name, so symbols compare and key environments by pointer.
+{
+    std::string name;
+    symbol(const std::string &name_) {name = name_;}
+};
+
+symbol* intern(const std::string &name);
+
+extern symbol sym_nil, sym_true, sym_quote, sym_quasi_quote, sym_un_quote, sym_splice_un_quote, sym_rest;
 
 
-struct cell
+struct local_ref            //a lexical variable: how many frames to walk out, then which slot.
+{
+    int depth;
+    int slot;
+};
+
+struct cell                 //16 bytes: a type tag plus either an immediate or a typed pointer into the collected heap.
 {
-    typedef std::shared_ptr<cell> pcell;
     typedef cell (*proc_t) (const cell&);
     cell_type type;
-    cell* car; cell* cdr;
-    std::string str;
-    double n;
-    proc_t proc;
-    std::shared_ptr<environment> env;
+    union
+    {
+        double n;           //v_number
+        long long i;        //v_fixnum
+        proc_t proc;        //v_proc
+        cons *pair;         //v_list - null for the empty list
+        symbol *sym;        //v_symbol
+        std::string *str;   //v_string, v_string_builder
+        closure *func;      //v_function, v_macro
+        local_ref local;    //v_local
+        binding *global;    //v_global
+        hash_table *hash;   //v_hash
+        cell_vector *vec;   //v_vector
+        double_vector *dvec;    //v_double_vector
+        future *fut;        //v_future
+        const primitive *prim;      //v_primitive
+    };
 
     bool operator==(const cell&) const;
 
-    ~cell() {}
+    cell* car() const;      //pointers into the cons, or 0 if this isn't a non-empty list
+    cell* cdr() const;
+
     cell();
     cell(cell_type);
-    cell(cell_type, std::string);
+    cell(cell_type, const std::string&);
+    cell(cell_type, std::string*);
+    cell(symbol*);
     cell(double);
+    cell(long long);
     cell(proc_t);
-    cell(cell*, cell*); //cons
+    cell(const primitive*);
+    cell(const cell&, const cell&); //cons
 };
 
+struct primitive            //a native for an ordinary function: its arguments are counted, then evaluated into an array, before it's called.
+{
+    typedef cell (*fn_t) (const cell *args, int n);
+    const char *name;
+    fn_t fn;
+    int min_args;
+    int max_args;           //-1 for any number
+};
 
-struct environment
+struct cons
 {
-    std::map <std::string, cell> vars;
-    std::shared_ptr <environment> parent;
+    cell car;
+    cell cdr;
+};
 
-    cell& get(std::string name);
-    environment(std::shared_ptr<environment> parent_ = std::shared_ptr<environment>()) {parent = parent_;}
+struct frame                //one per call or let: the slots are the variables, in the order the analyzer numbered them.
+{
+    frame *parent;
+    size_t nslots;
+    cell slots[1];
+};
+
+struct closure
+{
+    cell args;
+    cell body;              //already analyzed against the frame the closure was made in
+    frame *env;             //null for macros
+    size_t nslots;          //size of the frame a call allocates
+    bytecode *bc;           //compiled body, once the VM has called it
+    symbol *name;           //the global it was first defined as, or null for an anonymous lambda
+    bool stack_frame;       //nothing in the body can keep hold of a call's frame, so it can go on the frame stack
+    unsigned frame_check;   //the escape_epoch stack_frame was worked out in; 0 for never
+};
+
+inline cell* cell::car() const
+{
+    return type == v_list && pair? &pair->car : 0;
+}
+
+inline cell* cell::cdr() const
+{
+    return type == v_list && pair? &pair->cdr : 0;
+}
+
+
+struct binding              //a global variable. The address is stable, so analyzed code can point straight at it.
+{
+    symbol *name;
+    cell value;
+};
+
+struct environment          //the global namespace; lexical variables live in frames.
+{
+    std::map <symbol*, binding> vars;
+    environment *prev_env, *next_env;       //intrusive list of live environments - the collector treats them all as roots.
+
+    binding* lookup(symbol *name);          //creates an unbound (NIL) binding if there isn't one yet
+    cell& get(symbol *name);
+    environment();
+    ~environment();
+
+    private:
+    environment(const environment&);
+    environment& operator=(const environment&);
 };
 
-class parser
+class parser                //reads one top-level form per call, pulling tokens from the lexer only as it needs them.
 {
     private:
-    std::vector<token> tokens;
-    int index;
-    int ntokens;
+    lexer &lex;
     token t;
+    bool peeked;            //t is the next token, fetched but not yet consumed
     token last;
 
+    bool more();
     bool accept(token_type);
     bool expect(token_type);
-    token_type peek();
+    cell read_list();
 
     public:
-    parser(std::vector<token>);
+    parser(lexer &lex_);
     cell read();
+    bool at_end();          //nothing left but whitespace and comments
 };
 
 struct exception
@@ -0,0 +1,300 @@
+#include <charconv>
+#include <cstring>
+#include <iostream>
+
+#include "printer.h"
+#include "proc.h"
+#include "heap.h"
+#include "vector.h"
+
+output_buffer::output_buffer(std::ostream *out_, flush_policy policy_, size_t capacity_) : out(out_), policy(policy_), capacity(capacity_)
+{
+    text.reserve(capacity);
+}
+
+void output_buffer::write(const char *s, size_t n)
+{
+    text.append(s, n);
+    if (text.size() >= capacity || (policy == flush_lines && std::memchr(s, '\n', n)))
+        flush();
+}
+
+void output_buffer::flush()
+{
+    if (!out || text.empty())
+        return;
+    out->write(text.data(), text.size());
+    if (policy == flush_lines)
+        out->flush();
+    text.clear();
+}
+
+
+// Numbers go through to_chars into a buffer on the stack. Doubles use the
+// same six significant digits as printing them to a stream always has.
+
+static void print_fixnum(output_buffer &out, long long i)
+{
+    char buf[24];
+    std::to_chars_result r = std::to_chars(buf, buf + sizeof(buf), i);
+    out.write(buf, r.ptr - buf);
+}
+
+static void print_double(output_buffer &out, double n)
+{
+    char buf[32];
+    std::to_chars_result r = std::to_chars(buf, buf + sizeof(buf), n, std::chars_format::general, 6);
+    out.write(buf, r.ptr - buf);
+}
+
+static void print_address(output_buffer &out, const char *what, const void *p)
+{
+    char buf[24];
+    std::to_chars_result r = std::to_chars(buf, buf + sizeof(buf), (uintptr_t)p, 16);
+    out.put('<');
+    out.write(what, std::strlen(what));
+    out.write(" @0x", 4);
+    out.write(buf, r.ptr - buf);
+    out.put('>');
+}
+
+struct open_object          //a list or vector part-way through being printed, linked outwards on the C++ stack.
+{
+    const void *p;
+    const open_object *outer;
+};
+
+static bool is_open(const open_object *o, const void *p)
+{
+    for (; o; o = o->outer)
+        if (o->p == p)
+            return true;
+    return false;
+}
+
+static void print(output_buffer &out, const cell &x, const print_limits &limits, const open_object *outer, size_t depth);
+
+static bool enter(output_buffer &out, const void *p, const print_limits &limits, const open_object *outer, size_t depth)     //false if this container shouldn't be printed here.
+{
+    char probe;
+    if ((limits.depth && depth >= limits.depth) || &probe < stack_limit)
+    {
+        out.put('#');
+        return false;
+    }
+    if (is_open(outer, p))
+    {
+        out.write("#<circular>", 11);
+        return false;
+    }
+    return true;
+}
+
+static void print_list(output_buffer &out, const cell &x, const print_limits &limits, const open_object *outer, size_t depth)
+{
+    if (!x.car())
+    {
+        out.write("()", 2);
+        return;
+    }
+    if (!enter(out, x.pair, limits, outer, depth))
+        return;
+    open_object self = {x.pair, outer};
+    out.put('(');
+    const cell *iter = &x;
+    const cell *tortoise = &x;              //Brent's cycle finding on the cdrs: it jumps ahead to iter at each power of two.
+    size_t n = 0, power = 1, steps = 0;
+    while (true)
+    {
+        if (limits.length && n == limits.length)
+        {
+            out.write("...", 3);
+            break;
+        }
+        print(out, *iter->car(), limits, &self, depth + 1);
+        iter = iter->cdr();
+        n++;
+        if (!iter->car())
+        {
+            if (iter->type != v_list && !(*iter == cell()))
+            {
+                out.write(" . ", 3);
+                print(out, *iter, limits, &self, depth + 1);
+            }
+            break;
+        }
+        out.put(' ');
+        if (iter->pair == tortoise->pair)
+        {
+            out.write("...", 3);
+            break;
+        }
+        if (++steps == power)
+        {
+            tortoise = iter;
+            power *= 2;
+            steps = 0;
+        }
+    }
+    out.put(')');
+}
+
+static void print_vector(output_buffer &out, const cell &x, const print_limits &limits, const open_object *outer, size_t depth)
+{
+    if (!enter(out, x.vec, limits, outer, depth))
+        return;
+    open_object self = {x.vec, outer};
+    out.write("#(", 2);
+    size_t length = vector_length(x).i;
+    for (size_t i = 0; i < length; i++)
+    {
+        if (i)
+            out.put(' ');
+        if (limits.length && i == limits.length)
+        {
+            out.write("...", 3);
+            break;
+        }
+        if (x.type == v_vector)
+            print(out, x.vec->items[i], limits, &self, depth + 1);
+        else
+            print_double(out, x.dvec->items[i]);
+    }
+    out.put(')');
+}
+
+static void print(output_buffer &out, const cell &x, const print_limits &limits, const open_object *outer, size_t depth)
+{
+    switch(x.type)
+    {
+        case v_string:
+            out.put('"');
+            out.write(*x.str);
+            out.put('"');
+            break;
+        case v_symbol:
+            out.write(x.sym->name);
+            break;
+        case v_number:
+            print_double(out, x.n);
+            break;
+        case v_fixnum:
+            print_fixnum(out, x.i);
+            break;
+        case v_list:
+            print_list(out, x, limits, outer, depth);
+            break;
+        case v_proc:
+            print_address(out, "native function", (void*)x.proc);
+            break;
+        case v_primitive:
+            print_address(out, "native function", x.prim);
+            break;
+        case v_function:
+            print_address(out, "interpreted function", x.func);
+            break;
+        case v_macro:
+            print_address(out, "macro", x.func);
+            break;
+        case v_local:
+            out.write("<local ", 7);
+            print_fixnum(out, x.local.depth);
+            out.put(':');
+            print_fixnum(out, x.local.slot);
+            out.put('>');
+            break;
+        case v_global:
+            out.write(x.global->name->name);
+            break;
+        case v_hash:
+            print_address(out, "hash table", x.hash);
+            break;
+        case v_future:
+            print_address(out, "future", x.fut);
+            break;
+        case v_string_builder:
+            print_address(out, "string builder", x.str);
+            break;
+        case v_vector:
+        case v_double_vector:
+            print_vector(out, x, limits, outer, depth);
+            break;
+        default:
+            out.write("NIL", 3);
+            break;
+    }
+}
+
+void print_value(output_buffer &out, const cell &x, const print_limits &limits)
+{
+    print(out, x, limits, 0, 0);
+}
+
+std::string toString(const cell& x)
+{
+    return toString(x, print_limits());
+}
+
+std::string toString(const cell& x, const print_limits &limits)
+{
+    output_buffer out;
+    print_value(out, x, limits);
+    return out.str();
+}
+
+
+// From Lisp. Printing goes through one buffer for standard output. By
+// default it's passed on to cout after each call, so it stays in order with
+// anything else written there; with flush_when_full, a loop of prints
+// reaches cout a block at a time, and whatever else writes to cout calls
+// flush_console first.
+
+static thread_local output_buffer console(&std::cout, flush_calls);
+
+void set_console_policy(flush_policy policy)
+{
+    console.flush();
+    console.set_policy(policy);
+}
+
+void flush_console()
+{
+    console.flush();
+}
+
+cell proc_print(const cell &x)
+{
+    cell output = proc_eval(*x.car());
+    if (pending_go)
+        return cell();
+    print_value(console, output);
+    console.put('\n');
+    console.end_call();
+    return output;
+}
+
+cell proc_write(const cell &x)
+{
+    cell output = proc_eval(*x.car());
+    if (pending_go)
+        return cell();
+    print_value(console, output);
+    console.end_call();
+    return output;
+}
+
+cell proc_print_limited(const cell &arglist)      //(print-limited x [length] [depth]): print, showing at most length items of each list and depth levels of nesting.
+{
+    cell args[3];
+    if (!eval_args(arglist, args, 3))
+        return cell();
+    print_limits limits(10, 4);
+    if (args[1].type == v_fixnum && args[1].i > 0)
+        limits.length = args[1].i;
+    if (args[2].type == v_fixnum && args[2].i > 0)
+        limits.depth = args[2].i;
+    print_value(console, args[0], limits);
+    console.put('\n');
+    console.end_call();
+    return args[0];
+}
@@ -0,0 +1,66 @@
+#ifndef PRINTER_H_INCLUDED
+#define PRINTER_H_INCLUDED
+
+#include <ostream>
+#include <string>
+
+#include "parser.h"
+
+// The printer writes straight into an output_buffer, which hands its text
+// to a stream in blocks rather than building a string per level of
+// structure. A list that contains itself prints #<circular> where it
+// comes round again, and one whose tail loops back ends in "..." - so
+// printing always terminates. print_limits cuts off long or deep
+// structure, for logging values that might be huge.
+
+enum flush_policy
+{
+    flush_when_full,        //pass text on only when the buffer fills, or on flush()
+    flush_lines,            //...and at the end of every line, flushing the stream too, so a log stays current
+    flush_calls             //...and at the end of every print or write, so it stays in order with other output to the stream
+};
+
+class output_buffer
+{
+    private:
+    std::ostream *out;
+    flush_policy policy;
+    size_t capacity;
+    std::string text;
+
+    public:
+    output_buffer(std::ostream *out_ = 0, flush_policy policy_ = flush_when_full, size_t capacity_ = 4096);   //no stream: keep all the text, for str().
+    ~output_buffer() {flush();}
+    void put(char c)
+    {
+        text.push_back(c);
+        if ((c == '\n' && policy == flush_lines) || text.size() >= capacity)
+            flush();
+    }
+    void write(const char *s, size_t n);
+    void write(const std::string &s) {write(s.data(), s.size());}
+    void flush();
+    void end_call() {if (policy == flush_calls) flush();}     //a print or write is done.
+    void set_policy(flush_policy policy_) {policy = policy_;}
+    const std::string& str() const {return text;}
+};
+
+struct print_limits
+{
+    size_t length;          //items shown per list or vector before "...", or 0 for all of them
+    size_t depth;           //levels of nesting shown before "#", or 0 for all of them
+    print_limits(size_t length_ = 0, size_t depth_ = 0) : length(length_), depth(depth_) {}
+};
+
+void print_value(output_buffer &out, const cell &x, const print_limits &limits = print_limits());
+std::string toString(const cell& x);
+std::string toString(const cell& x, const print_limits &limits);
+
+void set_console_policy(flush_policy policy);     //for this thread's standard output: flush_calls unless set otherwise.
+void flush_console();           //before writing to cout some other way, so the text comes out in order.
+
+cell proc_print(const cell &x);
+cell proc_write(const cell &x);
+cell proc_print_limited(const cell &arglist);
+
+#endif // PRINTER_H_INCLUDED
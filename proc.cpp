@@ -1,169 +1,120 @@
 #include <iostream>
 #include <map>
-#include <sstream>
-#include <iomanip>
+#include <chrono>
+#include <new>
 
 #include "parser.h"
 #include "proc.h"
+#include "heap.h"
+#include "analyzer.h"
+#include "number.h"
+#include "profiler.h"
+#include "vector.h"
+#include "vm.h"
+#include "printer.h"
 
 
-std::shared_ptr<environment> global_env;
-std::shared_ptr<environment> env;
-
-
+thread_local environment *global_env;
+thread_local frame *env = 0;             //innermost lexical frame, or null at top level.
+thread_local symbol *pending_go = 0;     //set by go until its tagbody is reached.
+thread_local int eval_depth = 0;
+thread_local int max_eval_depth = 100000;
 
+struct env_guard            //restores the lexical environment on the way out, even when a go or an error unwinds through.
+{
+    frame *saved;
+    env_guard() {saved = env;}
+    ~env_guard() {env = saved;}
+};
 
-const cell nil(v_symbol, "NIL");
+struct frame_stack_guard    //drops the frames calls made here pushed, on the way out.
+{
+    size_t base;
+    frame_stack_guard() {base = frame_stack_top;}
+    ~frame_stack_guard() {frame_stack_top = base < frame_stack_floor? frame_stack_floor : base;}
+};
 
-std::string toString(const cell& x)
+static frame* call_frame(closure *func)
 {
-    switch(x.type)
+    if (func->frame_check != escape_epoch)      //worked out on the first call, when the names the body calls are more likely to be defined, and again after anything that could change the answer.
     {
-        case v_string:
-        {
-            std::stringstream ss;
-            ss << "\"" << x.str << "\"";
-            return ss.str();
-        }
-        case v_symbol:
-            return x.str;
-        case v_number:
-        {
-            std::stringstream ss;
-            ss << x.n;
-            return ss.str();
-        }
-        case v_list:
-        {
-            std::stringstream ss;
-            ss << "(";
-            const cell *iter = &x;
-            while (iter && iter->car)
-            {
-                ss << toString(*iter->car);
-                iter = iter->cdr;
-                if (iter && iter->car)
-                    ss << " ";
-            }
-            ss << ")";
-            return ss.str();
-        }
-        case v_proc:
-        {
-            std::stringstream ss;
-            ss << "<native function @" << std::hex << (int)x.proc << ">";
-            return ss.str();
-        }
-        case v_function:
-        {
-            std::stringstream ss;
-            ss << "<interpreted function @" << std::hex << (int)x.cdr->car << ">";
-            return ss.str();
-        }
-        case v_macro:
-        {
-            std::stringstream ss;
-            ss << "<macro @" << std::hex << (int)x.cdr->car << ">";
-            return ss.str();
-        }
-        default:
-            return "NIL";
+        func->stack_frame = true;
+        for (const cell *iter = &func->body; iter && iter->car(); iter = iter->cdr())
+            if (frame_can_escape(*iter->car()))
+                func->stack_frame = false;
+        func->frame_check = escape_epoch;
     }
+    frame *f = func->stack_frame? push_frame(func->env, func->nslots) : 0;
+    return f? f : make_frame(func->env, func->nslots);
 }
 
-cell proc_print(const cell &x)
-{
-    cell output = proc_eval(*x.car);
-    std::cout << toString(output) << "\n";
-    return output;
-}
 
-cell proc_write(const cell &x)
-{
-    cell output = proc_eval(*x.car);
-    std::cout << toString(output);
-    return output;
-}
+
+
+const cell nil;
+const cell truth(&sym_true);
 
 cell proc_define(const cell &arglist)
 {
-    if (!arglist.car || !arglist.cdr || !arglist.cdr->car)
+    if (!arglist.car() || !arglist.cdr() || !arglist.cdr()->car())
         throw exception("Error: function define expects two arguments.");
-    if (arglist.car->type != v_symbol)
+    if (arglist.car()->type != v_symbol)
         throw(exception("Error: tried to define non-symbol."));
-    cell result = proc_eval(*arglist.cdr->car);
-    global_env->vars[arglist.car->str] = result;
+    cell result = proc_eval(*arglist.cdr()->car());
+    if (pending_go)
+        return nil;
+    name_function(result, arglist.car()->sym);
+    global_env->get(arglist.car()->sym) = result;
     return result;
 }
 
-cell proc_add(const cell &x)
+void name_function(const cell &value, symbol *name)
 {
-    double total = 0;
-    const cell *iter = &x;
-    while(iter && iter->car)
-    {
-        total += proc_eval(*iter->car).n;
-        iter = iter->cdr;
-    }
-    return cell(total);
+    if ((value.type == v_function || value.type == v_macro) && !value.func->name)
+        value.func->name = name;
 }
 
-cell proc_subtract(const cell &x)
+static cell fold_numbers(const cell *args, int n, cell (*fn) (const cell&, const cell&), long long identity, bool from_first)
 {
-    double total = 0;
-    const cell *iter = &x;
-    bool first = true;
-    while(iter && iter->car)
-    {
-        total -= proc_eval(*iter->car).n;
-        iter = iter->cdr;
-        if (first && iter->cdr)
-        {
-            total = -total;
-            first = false;
-        }
-    }
-    return cell(total);
+    if (n == 2)                                 //the usual case - no loop.
+        return fn(args[0], args[1]);
+    cell total = identity;
+    int i = 0;
+    if (from_first && n > 1)                    //(- a b c) is a - b - c, but (- a) is 0 - a.
+        total = args[i++];
+    for (; i < n; i++)
+        total = fn(total, args[i]);
+    return total;
 }
 
-cell proc_multiply(const cell &x)
+cell prim_add(const cell *args, int n)
 {
-    double total = 1;
-    const cell *iter = &x;
-    while(iter && iter->car)
-    {
-        total *= proc_eval(*iter->car).n;
-        iter = iter->cdr;
-    }
-    return cell(total);
+    return fold_numbers(args, n, number_add, 0, false);
 }
 
-cell proc_divide(const cell &arglist)
+cell prim_subtract(const cell *args, int n)
 {
-    double total = 1;
-    const cell *iter = &arglist;
-    bool first = true;
-    while(iter && iter->car)
-    {
-        total /= proc_eval(*iter->car).n;
-        iter = iter->cdr;
-        if (first)
-        {
-            total = 1.0 / total;
-            first = false;
-        }
-    }
-    return cell(total);
+    return fold_numbers(args, n, number_subtract, 0, true);
+}
+
+cell prim_multiply(const cell *args, int n)
+{
+    return fold_numbers(args, n, number_multiply, 1, false);
+}
+
+cell prim_divide(const cell *args, int n)
+{
+    return fold_numbers(args, n, number_divide, 1, true);
 }
 
 cell proc_and(const cell &x)
 {
     cell result;
     const cell *iter = &x;
-    while(iter && iter->car)
+    while(iter && iter->car())
     {
-        result = proc_eval(*iter->car);
-        iter = iter->cdr;
+        result = proc_eval(*iter->car());
+        iter = iter->cdr();
         if (result == nil)
             break;
     }
@@ -174,105 +125,72 @@ cell proc_or(const cell &x)
 {
     cell result;
     const cell *iter = &x;
-    while(iter && iter->car)
+    while(iter && iter->car())
     {
-        result = proc_eval(*iter->car);
-        iter = iter->cdr;
+        result = proc_eval(*iter->car());
+        iter = iter->cdr();
         if (!(result == nil))
             break;
     }
     return result;
 }
 
-cell proc_not(const cell &x)
+cell prim_not(const cell *args, int n)
 {
-    if (!x.car || proc_eval(*x.car) == nil)
-        return cell(v_symbol, "TRUE");
-    else
-        return nil;
+    return args[0] == nil? truth : nil;
 }
 
 cell proc_if(const cell &arglist)
 {
-    if (!arglist.car)
+    if (!arglist.car())
         return nil;
-    cell cond = proc_eval(*arglist.car);
-    if (!arglist.cdr)
+    cell cond = proc_eval(*arglist.car());
+    if (!arglist.cdr())
         return nil;
     if (!(cond == nil))
     {
-        return arglist.cdr->car? proc_eval(*arglist.cdr->car) : nil;
+        return arglist.cdr()->car()? proc_eval(*arglist.cdr()->car()) : nil;
     }
     else
     {
-        if (!arglist.cdr->cdr)
+        if (!arglist.cdr()->cdr())
             return nil;
-        return arglist.cdr->cdr->car? proc_eval(*arglist.cdr->cdr->car) : nil;
+        return arglist.cdr()->cdr()->car()? proc_eval(*arglist.cdr()->cdr()->car()) : nil;
     }
 }
 
-cell proc_equal(const cell &arglist)
+cell prim_equal(const cell *args, int n)
 {
-    if (!arglist.car)
-        return nil;
-    cell first = proc_eval(*arglist.car);
-    const cell *iter = arglist.cdr;
-
-    while (iter && iter->car)
-    {
-        cell result = proc_eval(*iter->car);
-        if (!(result == first))
+    for (int i = 1; i < n; i++)
+        if (!(args[i] == args[0]))
             return nil;
-        iter = iter->cdr;
-    }
-
-    return cell(v_symbol, "TRUE");
+    return truth;
 }
 
-cell proc_less(const cell &arglist)
+cell prim_less(const cell *args, int n)
 {
-    if (!arglist.car || !arglist.cdr || !arglist.cdr->car)
-        return nil;
-    if (proc_eval(*arglist.car).n < proc_eval(*arglist.cdr->car).n)
-        return cell(v_symbol, "TRUE");
-    else
-        return nil;
+    return number_compare(args[0], args[1]) < 0? truth : nil;
 }
 
-cell proc_greater(const cell &arglist)
+cell prim_greater(const cell *args, int n)
 {
-    if (!arglist.car || !arglist.cdr || !arglist.cdr->car)
-        return nil;
-    if (proc_eval(*arglist.car).n > proc_eval(*arglist.cdr->car).n)
-        return cell(v_symbol, "TRUE");
-    else
-        return nil;
+    return number_compare(args[0], args[1]) > 0? truth : nil;
 }
 
-cell proc_less_equal(const cell &arglist)
+cell prim_less_equal(const cell *args, int n)
 {
-    if (!arglist.car || !arglist.cdr || !arglist.cdr->car)
-        return nil;
-    if (proc_eval(*arglist.car).n <= proc_eval(*arglist.cdr->car).n)
-        return cell(v_symbol, "TRUE");
-    else
-        return nil;
+    return number_compare(args[0], args[1]) <= 0? truth : nil;
 }
 
-cell proc_greater_equal(const cell &arglist)
+cell prim_greater_equal(const cell *args, int n)
 {
-    if (!arglist.car || !arglist.cdr || !arglist.cdr->car)
-        return nil;
-    if (proc_eval(*arglist.car).n >= proc_eval(*arglist.cdr->car).n)
-        return cell(v_symbol, "TRUE");
-    else
-        return nil;
+    return number_compare(args[0], args[1]) >= 0? truth : nil;
 }
 
 cell proc_quote(const cell &arglist)
 {
-    if (arglist.car)
-        return *arglist.car;
+    if (arglist.car())
+        return *arglist.car();
     else
         return nil;
 }
@@ -281,66 +199,57 @@ cell quasi_quote(const cell& x, bool &signalSplice)
 {
     if (x.type != v_list)
         return x;
-    if (x.car && x.car->type == v_symbol)
+    if (x.car() && x.car()->type == v_symbol)
     {
-        if (x.car->str == "SPLICE-UN-QUOTE")
+        if (x.car()->sym == &sym_splice_un_quote)
             signalSplice = true;
-        if (signalSplice || x.car->str == "UN-QUOTE")
-            return x.cdr? proc_unquote(*x.cdr) : nil;
+        if (signalSplice || x.car()->sym == &sym_un_quote)
+            return x.cdr()? proc_unquote(*x.cdr()) : nil;
     }
     cell head(v_list);
     cell *tail = &head;
-    cell *pretail = 0;      //cell before tail - so we can splice in ,@forms
     bool splicetail;
     const cell *iter = &x;
-    while (iter && iter->car)
+    while (iter && iter->car())
     {
         splicetail = false;
-        tail->car = new cell();
-        *tail->car = quasi_quote(*iter->car, splicetail);
+        cell item = quasi_quote(*iter->car(), splicetail);
+        if (pending_go)
+            return nil;
         if (splicetail)
         {
-            if (tail->car->type != v_list)
+            if (item.type != v_list)
                 throw(exception("Error: attempt to splice non-list (,@)"));
-            if (pretail)                                //if we have a pointer to the cons before the tail:
+            const cell *splice_iter = &item;                //copy the spliced conses - appending through them would rewrite the form they came from.
+            while (splice_iter && splice_iter->car())
             {
-                pretail->cdr = tail->car;               //append the spliced list to the pretail
-                delete tail;
-                tail = pretail->cdr;
-            }
-            else
-            {                                           //if we don't have a pretail, we only have a head, and it's currently empty.
-                head = *head.car;                       //replace the head cons with its contents.
-            }
-            while (tail && tail->car)      //cdr to the end of the list so more stuff can be appended.
-            {
-                pretail = tail;
-                tail = tail->cdr;
+                *tail = cell(*splice_iter->car(), cell(v_list));
+                tail = tail->cdr();
+                splice_iter = splice_iter->cdr();
             }
         }
-        else                                            //if the tail has not just been spliced in, we need to add a new cons to the end.
+        else
         {
-            tail->cdr = new cell(v_list);
-            pretail = tail;
-            tail = tail->cdr;
+            *tail = cell(item, cell(v_list));
+            tail = tail->cdr();
         }
-        iter = iter->cdr;
+        iter = iter->cdr();
     }
     return head;
 }
 
 cell proc_quasi_quote(const cell &arglist)      //arglist wrapper (actual implementation is recursive, so we need to strip out the arglist semantics)
 {
-    if (!arglist.car)
+    if (!arglist.car())
         return nil;
     bool _ = false;
-    return quasi_quote(*arglist.car, _);
+    return quasi_quote(*arglist.car(), _);
 }
 
 cell proc_unquote(const cell &arglist)
 {
-    if (arglist.car)
-        return proc_eval(*arglist.car);
+    if (arglist.car())
+        return proc_eval(*arglist.car());
     else
         return nil;
 }
@@ -349,338 +258,746 @@ cell proc_begin(const cell &arglist)
 {
     const cell *iter = &arglist;
     cell result;
-    while (iter && iter->car)
+    while (iter && iter->car())
     {
-        result = proc_eval(*iter->car);
-        iter = iter->cdr;
+        result = proc_eval(*iter->car());
+        iter = iter->cdr();
     }
     return result;
 }
 
+static size_t count_slots(const cell &args)         //must agree with frame_symbols in the analyzer.
+{
+    size_t n = 0;
+    const cell *iter = &args;
+    while (iter && iter->car())
+    {
+        if (iter->car()->sym != &sym_rest)
+            n++;
+        iter = iter->cdr();
+    }
+    return n;
+}
+
 cell proc_lambda(const cell &arglist)
 {
-    if(!arglist.car || arglist.car->type != v_list)
+    if(!arglist.car() || arglist.car()->type != v_list)
         throw(exception("Error: missing argument list for lambda"));
-    if (!arglist.cdr || !arglist.cdr->car)
+    if (!arglist.cdr() || !arglist.cdr()->car())
         throw(exception("Error: missing function body for lambda"));
 
-    const cell *iter = arglist.car;
-    while (iter && iter->car)
+    const cell *iter = arglist.car();
+    while (iter && iter->car())
     {
-        if (iter->car->type != v_symbol)
+        if (iter->car()->type != v_symbol)
             throw(exception("Error: argument names must be symbols (lambda)."));
-        iter = iter->cdr;
+        iter = iter->cdr();
     }
 
+    for (frame *f = env; f; f = f->parent)
+        if (on_frame_stack(f))
+        {
+            pin_frame_stack();                  //made where the body it's in didn't look like it could make one - by a macro defined since, say.
+            escape_epoch++;
+            break;
+        }
     cell func_cell(v_function);
-    func_cell.car = arglist.car;
-    func_cell.cdr = arglist.cdr;
-    func_cell.env = env;
+    func_cell.func = make_closure(*arglist.car(), *arglist.cdr(), env, count_slots(*arglist.car()));
     return func_cell;
 }
 
 cell proc_macro(const cell &arglist)
 {
-    if(!arglist.car || arglist.car->type != v_list)
+    if(!arglist.car() || arglist.car()->type != v_list)
         throw(exception("Error: missing argument list for macro"));
-    if (!arglist.cdr || !arglist.cdr->car)
+    if (!arglist.cdr() || !arglist.cdr()->car())
         throw(exception("Error: missing macro body for macro"));
 
-    const cell *iter = arglist.car;
-    while (iter && iter->car)
+    const cell *iter = arglist.car();
+    while (iter && iter->car())
     {
-        if (iter->car->type != v_symbol)
+        if (iter->car()->type != v_symbol)
             throw(exception("Error: argument names must be symbols (macro)."));
-        iter = iter->cdr;
+        iter = iter->cdr();
     }
 
     cell macro_cell(v_macro);
-    macro_cell.car = arglist.car;
-    macro_cell.cdr = arglist.cdr;
+    macro_cell.func = make_closure(*arglist.car(), *arglist.cdr(), 0, count_slots(*arglist.car()));
+    escape_epoch++;                             //calls to it may have been judged as calls to a function.
     return macro_cell;
 }
 
 cell expand_macro(const cell& macro, const cell& arglist)
 {
-    env = std::shared_ptr<environment>(new environment(env));       //push a new closure for the arguments.
+    frame *args = make_frame(0, macro.func->nslots);       //a fresh frame for the arguments - macros don't close over anything.
     const cell *arg_iter = &arglist;
-    const cell *name_iter = macro.car;
-    while (arg_iter && arg_iter->car && name_iter && name_iter->car)
+    const cell *name_iter = &macro.func->args;
+    size_t slot = 0;
+    while (arg_iter && arg_iter->car() && name_iter && name_iter->car())
     {
-        if (name_iter->car->str == "&REST")
+        if (name_iter->car()->sym == &sym_rest)
         {
-            if (!(name_iter->cdr && name_iter->cdr->car && name_iter->cdr->car->type == v_symbol))
+            if (!(name_iter->cdr() && name_iter->cdr()->car() && name_iter->cdr()->car()->type == v_symbol))
                 throw(exception("Error: no symbol provided for macro &rest argument name"));
-            env->vars[name_iter->cdr->car->str] = *arg_iter;
+            args->slots[slot] = *arg_iter;
             break;
         }
-        env->vars[name_iter->car->str] = *arg_iter->car;
-        arg_iter = arg_iter->cdr;
-        name_iter = name_iter->cdr;
+        args->slots[slot++] = *arg_iter->car();
+        arg_iter = arg_iter->cdr();
+        name_iter = name_iter->cdr();
     }
-    cell expandedval = proc_eval(*macro.cdr->car);
-    env = env->parent;      //pop the argument closure.
-    return expandedval;
+    env_guard guard;
+    env = args;
+    return proc_eval(*macro.func->body.car());
+}
+
+static closure* expand_call_site(const cell &arglist)
+{
+    cell &cache = *arglist.car();
+    const cell &macro = arglist.cdr()->car()->global->value;
+    const cell &scope = *arglist.cdr()->cdr()->car();
+    const cell &form = *arglist.cdr()->cdr()->cdr()->car();
+    cell expansion;
+    if (macro.type == v_macro)
+        expansion = analyze(expand_macro(macro, *form.cdr()), scope);
+    else if (macro.type == v_proc)                          //a special form now: analyze it as one, every time, since the form could change again.
+        expansion = analyze(form, scope);
+    else
+        expansion = analyze_call(form, scope);
+    cell result(v_function);                                //the body of a function of nothing, so the vm can keep compiled code with it.
+    result.func = make_closure(cell(v_list), cell(expansion, cell(v_list)), 0, 0);
+    if (macro.type == v_macro)
+        cache = cell(macro, result);
+    else if (macro.type != v_proc)
+        cache = cell(cell(), result);
+    return result.func;
+}
+
+closure* macro_call_expansion(const cell &arglist)     //(cache head scope form): a call site made by the analyzer.
+{
+    const cell &cache = *arglist.car();                     //(macro . expansion), or (NIL . call) if the head wasn't a macro - stale once that changes.
+    const cell &macro = arglist.cdr()->car()->global->value;
+    if (cache.car() && (macro.type == v_macro? cache.car()->type == v_macro && cache.car()->func == macro.func : cache.car()->type != v_macro && macro.type != v_proc))
+        return cache.cdr()->func;
+    return expand_call_site(arglist);
+}
+
+cell proc_macro_call(const cell &arglist)
+{
+    return proc_eval(*macro_call_expansion(arglist)->body.car());
 }
 
 cell proc_macroexpand(const cell &arglist)
 {
     cell macro;
-    if (!arglist.car || (macro = proc_eval(*arglist.car)).type != v_macro)
+    if (arglist.car())
+        macro = proc_eval(*arglist.car());
+    if (pending_go)
+        return nil;
+    if (!arglist.car() || macro.type != v_macro)
         throw(exception("Error: expected macro as first argument to macroexpand."));
-    return expand_macro(macro, arglist.cdr? *arglist.cdr : cell(v_list));
+    return expand_macro(macro, arglist.cdr()? *arglist.cdr() : cell(v_list));
 }
 
 cell proc_listvars(const cell &_)
 {
+    flush_console();
     std::cout << "Listing variables.\n";
-    std::map<std::string, cell>::iterator iter;
+    std::map<std::string, cell> sorted;                 //the environment is keyed by symbol address, so sort by name for display.
+    std::map<symbol*, binding>::iterator iter;
     for (iter = global_env->vars.begin(); iter != global_env->vars.end(); iter++)
+        sorted[iter->first->name] = iter->second.value;
+    std::map<std::string, cell>::iterator sorted_iter;
+    for (sorted_iter = sorted.begin(); sorted_iter != sorted.end(); sorted_iter++)
     {
-        std::cout << iter->first << ": ";
-        for (int i = iter->first.size(); i < 16; i++)
+        std::cout << sorted_iter->first << ": ";
+        for (int i = sorted_iter->first.size(); i < 16; i++)
             std::cout << " ";
-        std::cout << toString(iter->second) << "\n";
+        std::cout << toString(sorted_iter->second) << "\n";
     }
     return cell();
 }
 
-cell proc_cons(const cell &arglist)
+cell proc_time(const cell &arglist)              //evaluates its body like begin, and reports how long it took.
 {
-    if (!arglist.car || !arglist.cdr || !arglist.cdr->car)
-        return nil;
-    cell *car = new cell;
-    cell *cdr = new cell;
-    *car = proc_eval(*arglist.car);
-    *cdr = proc_eval(*arglist.cdr->car);
-    return cell(car, cdr);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    cell result = proc_begin(arglist);
+    report_time(start);
+    return result;
 }
 
-cell proc_car(const cell &arglist)
+void report_time(std::chrono::steady_clock::time_point start)
 {
-    if (!arglist.car)
-        return nil;
-    cell cons = proc_eval(*arglist.car);
-    if (cons.type != v_list || !cons.car)
-        return nil;
-    return *cons.car;
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    flush_console();
+    std::cout << "Elapsed: " << ms << " ms\n";
+}
+
+cell proc_gc(const cell &_)
+{
+    return cell((long long)gc_collect());
+}
+
+static void push_stat(cell *&tail, const char *name, const cell &value)
+{
+    *tail = cell(cell(intern(name)), cell(v_list));
+    tail = tail->cdr();
+    *tail = cell(value, cell(v_list));
+    tail = tail->cdr();
 }
 
-cell proc_cdr(const cell &arglist)
+static void push_stat(cell *&tail, const char *name, size_t value)
 {
-    if (!arglist.car)
+    push_stat(tail, name, cell((long long)value));
+}
+
+static void push_stat(cell *&tail, const char *name, double value)
+{
+    push_stat(tail, name, cell(value));
+}
+
+cell proc_heap_stats(const cell &_)         //property list, so (heap-stats) can be polled from a soak test.
+{
+    heap_stats s = gc_stats();
+    cell head(v_list);
+    cell *tail = &head;
+    push_stat(tail, "LIVE-OBJECTS", s.live_objects);
+    push_stat(tail, "FREE-OBJECTS", s.free_objects);
+    push_stat(tail, "LIVE-BYTES", s.live_bytes);
+    push_stat(tail, "HEAP-BYTES", s.heap_bytes);
+    push_stat(tail, "PAGES", s.pages);
+    push_stat(tail, "COLLECTIONS", s.collections);
+    push_stat(tail, "TOTAL-ALLOCS", s.total_allocs);
+    push_stat(tail, "TOTAL-FREED", s.total_freed);
+    push_stat(tail, "LAST-PAUSE-MS", s.last_pause_ms);
+    push_stat(tail, "MAX-PAUSE-MS", s.max_pause_ms);
+    push_stat(tail, "TOTAL-PAUSE-MS", s.total_pause_ms);
+    return head;
+}
+
+cell prim_cons(const cell *args, int n)
+{
+    return cell(args[0], args[1]);
+}
+
+cell prim_car(const cell *args, int n)
+{
+    if (args[0].type != v_list || !args[0].car())
         return nil;
-    cell cons = proc_eval(*arglist.car);
-    if (cons.type != v_list || !cons.cdr)
+    return *args[0].car();
+}
+
+cell prim_cdr(const cell *args, int n)
+{
+    if (args[0].type != v_list || !args[0].cdr())
         return nil;
-    return *cons.cdr;
+    return *args[0].cdr();
 }
 
-cell proc_list(const cell &arglist)
+cell prim_list(const cell *args, int n)
 {
     cell head(v_list);
-    cell *tail = &head;
-    const cell *iter = &arglist;
-    while (iter && iter->car)
+    for (int i = n; i-- > 0;)
+        head = cell(args[i], head);
+    return head;
+}
+
+static bool is_variable(const cell &ref)
+{
+    return ref.type == v_local || ref.type == v_global || ref.type == v_symbol;
+}
+
+static cell& place(const cell &ref)             //the storage a variable reference names.
+{
+    if (ref.type == v_local)
     {
-        tail->car = new cell();
-        *tail->car = proc_eval(*iter->car);
-        tail->cdr = new cell(v_list);
-        tail = tail->cdr;
-        iter = iter->cdr;
+        frame *f = env;
+        for (int depth = ref.local.depth; depth > 0; depth--)
+            f = f->parent;
+        return f->slots[ref.local.slot];
     }
-    return head;
+    if (ref.type == v_global)
+        return ref.global->value;
+    return global_env->get(ref.sym);            //unanalyzed symbol - only globals are visible.
 }
 
 cell proc_setq(const cell &arglist)
 {
-    if (!arglist.car || !arglist.cdr || !arglist.cdr->car)
+    if (!arglist.car() || !arglist.cdr() || !arglist.cdr()->car())
         throw(exception("Error: missing arguments to setq"));
-    if (arglist.car->type != v_symbol)
+    if (!is_variable(*arglist.car()))
         throw(exception("Error: tried to setq non-symbol."));
-    cell val = proc_eval(*arglist.cdr->car);
-    env->get(arglist.car->str) = val;
+    cell val = proc_eval(*arglist.cdr()->car());
+    if (pending_go)
+        return nil;
+    place(*arglist.car()) = val;
     return val;
 }
 
-cell proc_tagbody(const cell &arglist)
+cell tagbody_table(const cell &body)        //(tags . expressions): each tag is paired with the rest of the expressions from that point.
 {
-    std::map <std::string, int> tagindices;
-    std::vector <const cell*> expressions;
-    const cell *iter = &arglist;
-    while (iter && iter->car)
+    cell expressions(v_list);
+    cell *tail = &expressions;
+    const cell *iter = &body;
+    while (iter && iter->car())
     {
-        if (iter->car->type == v_symbol)
-            tagindices[iter->car->str] = expressions.size();
+        if (iter->car()->type != v_symbol)
+        {
+            *tail = cell(*iter->car(), cell(v_list));
+            tail = tail->cdr();
+        }
+        iter = iter->cdr();
+    }
+    cell tags(v_list);
+    const cell *pos = &expressions;
+    iter = &body;
+    while (iter && iter->car())
+    {
+        if (iter->car()->type == v_symbol)
+            tags = cell(cell(*iter->car(), *pos), tags);           //pushed on the front, so a repeated tag finds its last occurrence first.
         else
-            expressions.push_back(iter->car);
-        iter = iter->cdr;
+            pos = pos->cdr();
+        iter = iter->cdr();
     }
+    return cell(tags, expressions);
+}
+
+cell proc_tagbody(const cell &arglist)
+{
+    return proc_run_tagbody(tagbody_table(arglist));
+}
+
+cell proc_run_tagbody(const cell &arglist)      //takes the output of tagbody_table - the analyzer builds it once per form.
+{
+    const cell *iter = arglist.cdr();
     cell result;
-    int exprindex = 0;
-    while (exprindex < expressions.size())
+    while (iter && iter->car())
     {
-        try
+        result = proc_eval(*iter->car());
+        if (pending_go)
         {
-            result = proc_eval(*expressions[exprindex]);
-            exprindex++;
-        }
-        catch (tag_sym t)
-        {
-            if (tagindices.find(t.str) == tagindices.end())
-                throw(t);                                   //doesn't belong to this tag body - pass it on to the next, or to the REPL if it isn't caught.
-            else
-                exprindex = tagindices[t.str];
+            const cell *tag_iter = arglist.car();
+            while (tag_iter && tag_iter->car() && tag_iter->car()->car()->sym != pending_go)
+                tag_iter = tag_iter->cdr();
+            if (!tag_iter || !tag_iter->car())
+                return result;                              //doesn't belong to this tag body - leave it pending for the next, or the REPL.
+            pending_go = 0;
+            iter = tag_iter->car()->cdr();
+            continue;
         }
+        iter = iter->cdr();
     }
     return result;
 }
 
-cell proc_go(const cell &arglist)
+cell proc_go(const cell &arglist)               //doesn't transfer control itself: every eval unwinds while a go is pending, until a tagbody claims it.
 {
-    if (!arglist.car || arglist.car->type != v_symbol)
+    if (!arglist.car() || arglist.car()->type != v_symbol)
         throw(exception("Error: expected symbol as argument to go."));
-    throw(tag_sym(arglist.car->str));
+    pending_go = arglist.car()->sym;
+    return nil;
 }
 
 cell proc_nreverse(const cell &arglist)
 {
     cell head;
-    if (!arglist.car || (head = proc_eval(*arglist.car)).type != v_list)
+    if (arglist.car())
+        head = proc_eval(*arglist.car());
+    if (pending_go)
+        return nil;
+    if (!arglist.car() || head.type != v_list)
         throw(exception("Error: expected list as argument to nreverse."));
-    cell *last = new cell(v_list);
-    cell *tail = new cell(v_list);
-    *tail = head;
-    while (tail && tail->car)
+    cell last(v_list);
+    cell tail = head;
+    while (tail.car())
     {
-        cell *next = tail->cdr;
-        tail->cdr = last;
+        cell next = *tail.cdr();
+        *tail.cdr() = last;
         last = tail;
         tail = next;
     }
-    env->get(arglist.car->str) = *last;
-    return *last;
+    if (is_variable(*arglist.car()))
+        place(*arglist.car()) = last;
+    return last;
 }
 
-cell proc_let(const cell &arglist)
+frame* let_frame(const cell &arglist)        //evaluates the assignments of a let into a new frame.
 {
-    if (!arglist.car || arglist.car->type != v_list)
+    if (!arglist.car() || arglist.car()->type != v_list)
         throw(exception("Error: function let expects assignment list as first argument."));
-    std::shared_ptr<environment> newenv(new environment(env));
-    const cell *iter = arglist.car;
-    while (iter && iter->car)
+    size_t nslots = 0;
+    const cell *iter = arglist.car();
+    while (iter && iter->car())
+    {
+        if (iter->car()->type != v_symbol && (iter->car()->type != v_list || !iter->car()->car() || iter->car()->car()->type != v_symbol || !iter->car()->cdr() || !iter->car()->cdr()->car()))        //in order: not a list || no first item || first item not symbol || no link to second item || second item has no value
+            throw(exception("Error: let assignment must be symbol or symbol-value pair."));
+        nslots++;
+        iter = iter->cdr();
+    }
+    frame *newenv = make_frame(env, nslots);            //slots are numbered in assignment order, same as the analyzer.
+    size_t slot = 0;
+    iter = arglist.car();
+    while (iter && iter->car())
+    {
+        if (iter->car()->type != v_symbol)
+            newenv->slots[slot] = proc_eval(*iter->car()->cdr()->car());
+        slot++;
+        iter = iter->cdr();
+    }
+    return newenv;
+}
+
+cell proc_let(const cell &arglist)
+{
+    frame *newenv = let_frame(arglist);
+    env_guard guard;
+    env = newenv;
+    cell result;
+    const cell *iter = arglist.cdr();
+    while (iter && iter->car())
     {
-        if (iter->car->type == v_symbol)
+        result = proc_eval(*iter->car());
+        iter = iter->cdr();
+    }
+    return result;
+}
+
+
+bool eval_args(const cell &arglist, cell *args, int n)
+{
+    const cell *iter = &arglist;
+    for (int i = 0; i < n; i++)
+    {
+        if (iter && iter->car())
         {
-            newenv->vars[iter->car->str] = nil;
+            args[i] = proc_eval(*iter->car());
+            if (pending_go)
+                return false;
+            iter = iter->cdr();
         }
         else
+            args[i] = nil;
+    }
+    return true;
+}
+
+static void check_arity(const primitive *p, int n)
+{
+    if (n < p->min_args || (p->max_args >= 0 && n > p->max_args))
+        throw(exception(std::string("Error: wrong number of arguments to ") + p->name + "."));
+}
+
+cell call_primitive(const primitive *p, const cell *args, int n)
+{
+    check_arity(p, n);
+    return p->fn(args, n);
+}
+
+#ifdef __GNUC__
+__attribute__((noinline))                       //keeps the buffer out of proc_eval's own frame, which every level of recursion pays for.
+#endif
+static cell eval_primitive(const cell &head, const cell &arglist)      //the arguments are evaluated into an array on the stack - or on the heap, if there are a lot of them.
+{
+    const primitive *p = head.prim;
+    alignas(cell) char buffer[8 * sizeof(cell)];        //not constructed: each is filled in before it's read.
+    cell *args = (cell*)buffer;
+    int n = 0;
+    const cell *iter = &arglist;
+    for (; n < 8 && iter && iter->car(); n++, iter = iter->cdr())
+    {
+        new (&args[n]) cell(proc_eval(*iter->car()));
+        if (pending_go)
+            return nil;
+    }
+    if (iter && iter->car())                    //more than fit: move to a vector, which keeps them alive.
+    {
+        int total = n;
+        for (const cell *rest = iter; rest && rest->car(); rest = rest->cdr())
+            total++;
+        check_arity(p, total);
+        cell *spilled = make_vector(total)->items;
+        for (int i = 0; i < n; i++)
+            spilled[i] = args[i];
+        args = spilled;
+        for (; n < total; n++, iter = iter->cdr())
         {
-            if (iter->car->type != v_list || !iter->car->car || iter->car->car->type != v_symbol || !iter->car->cdr || !iter->car->cdr->car)        //in order: not a list || no first item || first item not symbol || no link to second item || second item has no value
-                throw(exception("Error: let assignment must be symbol or symbol-value pair."));
-            newenv->vars[iter->car->car->str] = proc_eval(*iter->car->cdr->car);
+            args[n] = proc_eval(*iter->car());
+            if (pending_go)
+                return nil;
         }
-        iter = iter->cdr;
     }
-    std::shared_ptr<environment> oldenv = env;
-    env = newenv;
-    cell result;
-    iter = arglist.cdr;
-    while (iter && iter->car)
+    check_arity(p, n);
+    if (profiling)                              //entered only now, so calls in the arguments are the caller's, as they are in the vm.
     {
-        result = proc_eval(*iter->car);
-        iter = iter->cdr;
+        profile_scope native;
+        native.enter(head);
+        return p->fn(args, n);
     }
-    env = oldenv;
-    return result;
+    return p->fn(args, n);
 }
 
+static cell eval_native_profiled(const cell &head, const cell &arglist)    //a native that evaluates all its arguments, run as the vm runs it so the profile comes out the same.
+{
+    int n = 0;
+    for (const cell *iter = &arglist; iter && iter->car(); iter = iter->cdr())
+        n++;
+    cell *args = make_vector(n)->items;
+    int i = 0;
+    for (const cell *iter = &arglist; iter && iter->car(); iter = iter->cdr())
+    {
+        args[i++] = proc_eval(*iter->car());
+        if (pending_go)
+            return nil;
+    }
+    profile_scope native;
+    native.enter(head);
+    return call_native(head.proc, args, n);
+}
 
 cell proc_eval_arglist(const cell &arglist)     // all procs take an uneval'd arg list, in order for functions such as quote to use the same interface (they don't eval their args):
 {                                               // proc_eval_arglist is an interface that is called from LISP code, which unzips the argument list and passes it to eval.
                                                 // proc_eval contains the actual eval implementation.
     const cell *iter = &arglist;
     cell result;
-    while (iter && iter->car)
+    while (iter && iter->car())
     {
-        result = proc_eval(proc_eval(*iter->car));      //eval the argument, then perform the _requested_ eval function.
-        iter = iter->cdr;
+        result = eval_toplevel(proc_eval(*iter->car()));      //eval the argument, then perform the _requested_ eval function (at top level - it can't see our locals).
+        iter = iter->cdr();
     }
     return result;
 }
 
-cell proc_eval(const cell &x)
+cell eval_toplevel(const cell &x)
 {
-    bool listvars = false;
-    if (listvars)
-        proc_listvars(cell());
-    if (x.type == v_string || x.type == v_number || x.type == v_function)
+    cell code = analyze(x, cell(v_list));
+    env_guard guard;
+    env = 0;
+    return proc_eval(code);
+}
+
+static cell eval_atom(const cell &x)
+{
+    if (x.type == v_string || x.type == v_number || x.type == v_fixnum || x.type == v_function || x.type == v_proc || x.type == v_primitive || x.type == v_hash
+        || x.type == v_vector || x.type == v_double_vector || x.type == v_future || x.type == v_string_builder)
         return x;
+    else if (x.type == v_local)
+    {
+        frame *f = env;
+        for (int depth = x.local.depth; depth > 0; depth--)
+            f = f->parent;
+        return f->slots[x.local.slot];
+    }
+    else if (x.type == v_global)
+        return x.global->value;
     else if (x.type == v_symbol)
     {
-        //std::cout << "fetching var " << x.str << ": " << toString(env->get(x.str)) << "\n";
-        return env->get(x.str);
+        //std::cout << "fetching var " << x.sym->name << ": " << toString(global_env->get(x.sym)) << "\n";
+        return global_env->get(x.sym);
     }
     else if (x.type == v_list)
+        return nil;
+    else
+        throw(exception("Unrecognised cell type! (eval)"));
+}
+
+struct depth_guard          //counts the calls this eval is waiting on - tail calls reuse the one they replace.
+{
+    bool counted;
+    depth_guard() {counted = false;}
+    void enter()
+    {
+        if (counted)
+            return;
+        if (eval_depth >= max_eval_depth)
+            throw(exception("Error: maximum evaluation depth exceeded."));
+        eval_depth++;
+        counted = true;
+    }
+    ~depth_guard() {if (counted) eval_depth--;}
+};
+
+cell proc_eval(const cell &x)
+{
+    bool listvars = false;
+    if (listvars)
+        proc_listvars(cell());
+    if (pending_go)
+        return nil;                     //unwinding to a tagbody - evaluate nothing more on the way.
+    if (x.type != v_list || !x.car())
+        return eval_atom(x);
+    char probe;
+    if (&probe < stack_limit)
+        throw(exception("Error: out of stack - the tree walker nests calls on the C++ stack."));
+
+    env_guard guard;                    //tail positions below replace env; put it back for our caller.
+    frame_stack_guard frames;
+    depth_guard depth;
+    profile_scope profile;              //the call this eval is running, when the profiler is on.
+    cell form = x;
+    while (true)                        //each pass evaluates form; a tail position sets form and goes round again instead of recursing.
     {
-        if (!x.car)
+        if (pending_go)
             return nil;
-        cell head = proc_eval(*x.car);
+        if (form.type != v_list || !form.car())
+            return eval_atom(form);
+        const cell &head_form = *form.car();
+        if (head_form.type == v_proc && head_form.proc == proc_macro_call)     //a call site: go on with the call or expansion it stands for.
+        {
+            const cell &site = *form.cdr();
+            form = *macro_call_expansion(site)->body.car();
+            const cell &callee = site.cdr()->car()->global->value;
+            if (profiling && callee.type == v_macro)
+                profile.enter(callee);
+            continue;
+        }
+        cell head = head_form.type == v_global? head_form.global->value : proc_eval(head_form);      //a call to a global reads its binding directly, which DEFINE and SETQ update in place.
+        if (pending_go)
+            return nil;
+        const cell &arglist = *form.cdr();
+        if (head.type == v_primitive)
+        {
+            return eval_primitive(head, arglist);
+        }
         if (head.type == v_proc)
-            return head.proc(x.cdr? *x.cdr : nil);
+        {
+            if (head.proc == proc_if)
+            {
+                if (!arglist.car())
+                    return nil;
+                cell cond = proc_eval(*arglist.car());
+                const cell *branch = arglist.cdr();
+                if (cond == nil)
+                    branch = branch->cdr();
+                if (!branch || !branch->car())
+                    return nil;
+                form = *branch->car();
+                continue;
+            }
+            if (head.proc == proc_begin || head.proc == proc_let)
+            {
+                const cell *body_iter = &arglist;
+                if (head.proc == proc_let)
+                {
+                    env = let_frame(arglist);
+                    body_iter = arglist.cdr();
+                }
+                if (!body_iter->car())
+                    return nil;
+                while (body_iter->cdr()->car())
+                {
+                    proc_eval(*body_iter->car());
+                    body_iter = body_iter->cdr();
+                }
+                form = *body_iter->car();
+                continue;
+            }
+            if (profiling && !special_native(head.proc))     //special forms aren't calls in the vm, so they aren't here either.
+                return eval_native_profiled(head, arglist);
+            return head.proc(arglist);
+        }
         if (head.type == v_function)
         {
-            std::shared_ptr<environment> oldenv = env;
-            std::shared_ptr<environment> newenv(new environment(head.env));
-            const cell *name_iter = head.car;
-            const cell *arg_iter = x.cdr;
-            while (arg_iter && arg_iter->car && name_iter && name_iter->car)
+            depth.enter();
+            frame *newenv = call_frame(head.func);
+            size_t slot = 0;
+            const cell *name_iter = &head.func->args;
+            const cell *arg_iter = &arglist;
+            while (arg_iter && arg_iter->car() && name_iter && name_iter->car())
             {
-                if (name_iter->car->str == "&REST")
+                if (name_iter->car()->sym == &sym_rest)
                 {
-                    if (!(name_iter->cdr && name_iter->cdr->car && name_iter->cdr->car->type == v_symbol))
+                    if (!(name_iter->cdr() && name_iter->cdr()->car() && name_iter->cdr()->car()->type == v_symbol))
                         throw(exception("Error: expected name for &rest parameter"));
                     cell head(v_list);
                     cell *tail = &head;
-                    while (arg_iter && arg_iter->car)
+                    while (arg_iter && arg_iter->car())
                     {
-                        tail->car = new cell();
-                        *tail->car = proc_eval(*arg_iter->car);
-                        tail->cdr = new cell(v_list);
-                        tail = tail->cdr;
-                        arg_iter = arg_iter->cdr;
+                        *tail = cell(proc_eval(*arg_iter->car()), cell(v_list));
+                        tail = tail->cdr();
+                        arg_iter = arg_iter->cdr();
                     }
-                    newenv->vars[name_iter->cdr->car->str] = head;
-                    name_iter = name_iter->cdr->cdr;
+                    newenv->slots[slot] = head;
+                    name_iter = name_iter->cdr()->cdr();
                     break;                              //skip the outer loop so we don't dereference the null car pointer.
                 }
-                newenv->vars[name_iter->car->str] = proc_eval(*arg_iter->car);
-                arg_iter = arg_iter->cdr;
-                name_iter = name_iter->cdr;
+                newenv->slots[slot++] = proc_eval(*arg_iter->car());
+                arg_iter = arg_iter->cdr();
+                name_iter = name_iter->cdr();
             }
-            if (arg_iter && arg_iter->car)
+            if (arg_iter && arg_iter->car())
                 throw(exception("Error: too many arguments to function"));
-            if (name_iter && name_iter->car)
+            if (name_iter && name_iter->car())
                 throw(exception("Error: too few arguments to function"));
+            if (profiling)
+                profile.enter(head);        //once the arguments are in: evaluating them was the caller's work.
+            if (on_frame_stack(newenv))
+                newenv = settle_frame(newenv, frames.base);     //over the frame of the call this one replaces, if it was on the frame stack too.
+            else
+                frame_stack_top = frames.base < frame_stack_floor? frame_stack_floor : frames.base;
             env = newenv;
-            cell result;
-            cell *body_iter = head.cdr;
-            while (body_iter && body_iter->car)
+            const cell *body_iter = &head.func->body;
+            if (!body_iter->car())
+                return nil;
+            while (body_iter->cdr()->car())
             {
-                result = proc_eval(*body_iter->car);
-                body_iter = body_iter->cdr;
+                proc_eval(*body_iter->car());
+                body_iter = body_iter->cdr();
             }
-            env = oldenv;
-            return result;
+            form = *body_iter->car();
+            continue;
         }
-        if (head.type == v_macro)
-            return proc_eval(expand_macro(head, x.cdr? *x.cdr : cell(v_list)));
+        if (head.type == v_macro)           //the analyzer makes a call site of every call by a name that could be a macro, so this one was called some other way.
+            throw(exception("Error: a macro can only be called by a global name that wasn't a primitive when the call was read."));
 
         throw(exception("Error: attempt to call non-proc"));
-
     }
-    else
+}
+
+cell apply_function(const cell &fn, const cell *args, int n)     //for natives that take a function argument: the arguments are bound straight into the frame, not quoted and evaluated again.
+{
+    if (pending_go)
+        return nil;
+    profile_scope profile;
+    if (profiling)
+        profile.enter(fn);
+    if (fn.type == v_primitive)
+        return call_primitive(fn.prim, args, n);
+    if (fn.type == v_proc)
+        return call_native(fn.proc, args, n);
+    if (fn.type != v_function)
+        throw(exception("Error: attempt to call non-proc"));
+    depth_guard depth;
+    depth.enter();
+    closure *func = fn.func;
+    frame_stack_guard frames;
+    frame *newenv = call_frame(func);
+    size_t slot = 0;
+    int i = 0;
+    const cell *name_iter = &func->args;
+    while (name_iter && name_iter->car())
     {
-        throw(exception("Unrecognised cell type! (eval)"));
+        if (i == n)
+            throw(exception("Error: too few arguments to function"));
+        if (name_iter->car()->sym == &sym_rest)
+        {
+            if (!(name_iter->cdr() && name_iter->cdr()->car() && name_iter->cdr()->car()->type == v_symbol))
+                throw(exception("Error: expected name for &rest parameter"));
+            cell rest(v_list);
+            for (int j = n; j-- > i;)
+                rest = cell(args[j], rest);
+            newenv->slots[slot] = rest;
+            i = n;
+            break;
+        }
+        newenv->slots[slot++] = args[i++];
+        name_iter = name_iter->cdr();
     }
+    if (i < n)
+        throw(exception("Error: too many arguments to function"));
+    env_guard guard;
+    env = newenv;
+    cell result;
+    for (const cell *body_iter = &func->body; body_iter && body_iter->car() && !pending_go; body_iter = body_iter->cdr())
+        result = proc_eval(*body_iter->car());
+    return pending_go? nil : result;
 }
@@ -1,26 +1,25 @@
 #ifndef PROC_H_INCLUDED
 #define PROC_H_INCLUDED
 
-#include "parser.h"
+#include <chrono>
 
-std::string toString(const cell& x);
+#include "parser.h"
 
-cell proc_print(const cell &x);
-cell proc_write(const cell &x);
 cell proc_define(const cell &arglist);
-cell proc_add(const cell &x);
-cell proc_subtract(const cell &x);
-cell proc_multiply(const cell &x);
-cell proc_divide(const cell &arglist);
+void name_function(const cell &value, symbol *name);     //a closure keeps the first name it's defined under, for the profiler.
+cell prim_add(const cell *args, int n);
+cell prim_subtract(const cell *args, int n);
+cell prim_multiply(const cell *args, int n);
+cell prim_divide(const cell *args, int n);
 cell proc_and(const cell &x);
 cell proc_or(const cell &x);
-cell proc_not(const cell &x);
+cell prim_not(const cell *args, int n);
 cell proc_if(const cell &arglist);
-cell proc_equal(const cell &arglist);
-cell proc_less(const cell &arglist);
-cell proc_greater(const cell &arglist);
-cell proc_less_equal(const cell &arglist);
-cell proc_greater_equal(const cell &arglist);
+cell prim_equal(const cell *args, int n);
+cell prim_less(const cell *args, int n);
+cell prim_greater(const cell *args, int n);
+cell prim_less_equal(const cell *args, int n);
+cell prim_greater_equal(const cell *args, int n);
 cell proc_quote(const cell &arglist);
 cell proc_quasi_quote(const cell &arglist);
 cell proc_unquote(const cell &arglist);
@@ -33,19 +32,30 @@ cell proc_nreverse(const cell &arglist);
 cell proc_let(const cell &arglist);
 cell proc_tagbody(const cell &arglist);
 cell proc_go(const cell &arglist);
+cell proc_run_tagbody(const cell &arglist);
+cell tagbody_table(const cell &body);
 cell proc_eval(const cell &x);
 cell proc_eval_arglist(const cell &arglist);
-cell proc_cons(const cell &arglist);
-cell proc_car(const cell &arglist);
-cell proc_cdr(const cell &arglist);
-cell proc_list(const cell &arglist);
+bool eval_args(const cell &arglist, cell *args, int n);      //the first n arguments a native was given, evaluated; missing ones are NIL. false if a go is unwinding.
+cell apply_function(const cell &fn, const cell *args, int n);     //calls a function or native on n evaluated arguments.
+cell call_primitive(const primitive *p, const cell *args, int n);     //throws an exception if n is out of the range p takes.
+cell eval_toplevel(const cell &x);         //analyze then evaluate, outside any lexical scope.
+cell proc_macro_call(const cell &arglist);
+cell expand_macro(const cell& macro, const cell& arglist);
+closure* macro_call_expansion(const cell &arglist);
+frame* let_frame(const cell &arglist);
+cell proc_time(const cell &arglist);
+void report_time(std::chrono::steady_clock::time_point start);
+cell proc_gc(const cell &_);
+cell proc_heap_stats(const cell &_);
+cell prim_cons(const cell *args, int n);
+cell prim_car(const cell *args, int n);
+cell prim_cdr(const cell *args, int n);
+cell prim_list(const cell *args, int n);
 cell proc_setq(const cell &arglist);
 
-struct tag_sym
-{
-    std::string str;
-    tag_sym() {}
-    tag_sym(std::string str_) {str = str_;}
-};
+extern thread_local symbol *pending_go;      //non-null while a go is unwinding to its tagbody
+extern thread_local int eval_depth;          //pending calls to interpreted functions, in either engine
+extern thread_local int max_eval_depth;      //past this, a call raises an error rather than risk the C++ stack.
 
 #endif // PROC_H_INCLUDED
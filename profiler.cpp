@@ -0,0 +1,252 @@
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <algorithm>
+#include <chrono>
+
+#include "profiler.h"
+#include "proc.h"
+#include "heap.h"
+#include "printer.h"
+
+extern thread_local environment *global_env;
+
+thread_local bool profiling = false;
+
+struct profile_function     //totals for everything profiled under one name.
+{
+    std::string name;
+    size_t calls;
+    long long inclusive_ns;
+    long long exclusive_ns;
+    size_t inclusive_allocs;
+    size_t exclusive_allocs;
+    int active;             //calls still on the stack: a recursive call's time is already part of the outermost one's.
+};
+
+struct profile_node         //one path through the call tree. Node 0 is the root, above every top-level call.
+{
+    int function;
+    int parent;
+    std::vector<int> children;
+    long long self_ns;
+};
+
+struct profile_entry        //a call in progress.
+{
+    int function;
+    int node;
+    long long start_ns;
+    long long child_ns;
+    size_t start_allocs;
+    size_t child_allocs;
+};
+
+static thread_local std::vector<profile_function> functions;
+static thread_local std::vector<profile_node> nodes;
+static thread_local std::vector<profile_entry> calls;
+static thread_local std::unordered_map<symbol*, int> function_ids;      //null for anything without a name
+static thread_local std::map<cell::proc_t, symbol*> native_names;
+static thread_local std::unordered_map<const primitive*, symbol*> primitive_names;
+
+static long long now_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void name_natives()      //the name each native is bound to - the first alphabetically, if there are several.
+{
+    native_names.clear();
+    primitive_names.clear();
+    std::map<symbol*, binding>::iterator iter;
+    for (iter = global_env->vars.begin(); iter != global_env->vars.end(); iter++)
+    {
+        const cell &value = iter->second.value;
+        if (value.type == v_primitive)
+            primitive_names[value.prim] = intern(value.prim->name);     //interned here, not on every call: intern takes the symbol table's lock.
+        if (value.type != v_proc)
+            continue;
+        symbol *&name = native_names[value.proc];
+        if (!name || iter->first->name < name->name)
+            name = iter->first;
+    }
+    native_names[proc_run_tagbody] = intern("TAGBODY");       //the analyzer's replacement for it.
+}
+
+static int function_id(const cell &callee)
+{
+    symbol *name = 0;
+    if (callee.type == v_function || callee.type == v_macro)
+        name = callee.func->name;
+    else if (callee.type == v_primitive)
+    {
+        symbol *&known = primitive_names[callee.prim];
+        if (!known)
+            known = intern(callee.prim->name);      //not bound to any global when profiling started.
+        name = known;
+    }
+    else if (callee.type == v_proc)
+    {
+        std::map<cell::proc_t, symbol*>::iterator iter = native_names.find(callee.proc);
+        if (iter != native_names.end())
+            name = iter->second;
+    }
+    std::unordered_map<symbol*, int>::iterator iter = function_ids.find(name);
+    if (iter != function_ids.end())
+        return iter->second;
+    profile_function f = {name? name->name : "(anonymous)", 0, 0, 0, 0, 0, 0};
+    functions.push_back(f);
+    return function_ids[name] = functions.size() - 1;
+}
+
+static int child_node(int parent, int function)
+{
+    std::vector<int> &children = nodes[parent].children;
+    for (size_t i = 0; i < children.size(); i++)
+        if (nodes[children[i]].function == function)
+            return children[i];
+    profile_node node = {function, parent, std::vector<int>(), 0};
+    nodes.push_back(node);
+    nodes[parent].children.push_back(nodes.size() - 1);     //not through the reference: push_back may have moved it.
+    return nodes.size() - 1;
+}
+
+void profile_enter(const cell &callee)
+{
+    int function = function_id(callee);
+    int node = child_node(calls.empty()? 0 : calls.back().node, function);
+    functions[function].calls++;
+    functions[function].active++;
+    profile_entry entry = {function, node, 0, 0, gc_total_allocs(), 0};
+    entry.start_ns = now_ns();
+    calls.push_back(entry);
+}
+
+void profile_exit()
+{
+    if (calls.empty())
+        return;                 //entered before the profiler was started.
+    long long inclusive = now_ns() - calls.back().start_ns;
+    size_t allocs = gc_total_allocs() - calls.back().start_allocs;
+    profile_entry entry = calls.back();
+    calls.pop_back();
+    profile_function &f = functions[entry.function];
+    f.exclusive_ns += inclusive - entry.child_ns;
+    f.exclusive_allocs += allocs - entry.child_allocs;
+    if (--f.active == 0)
+    {
+        f.inclusive_ns += inclusive;
+        f.inclusive_allocs += allocs;
+    }
+    nodes[entry.node].self_ns += inclusive - entry.child_ns;
+    if (!calls.empty())
+    {
+        calls.back().child_ns += inclusive;
+        calls.back().child_allocs += allocs;
+    }
+}
+
+size_t profile_depth()
+{
+    return calls.size();
+}
+
+void profile_unwind(size_t depth)
+{
+    while (calls.size() > depth)
+        profile_exit();
+}
+
+cell proc_profile_start(const cell &_)          //throws away anything profiled before.
+{
+    calls.clear();
+    functions.clear();
+    function_ids.clear();
+    nodes.clear();
+    profile_node root = {-1, -1, std::vector<int>(), 0};
+    nodes.push_back(root);
+    name_natives();
+    profiling = true;
+    return cell();
+}
+
+cell proc_profile_stop(const cell &_)           //calls still running are counted up to now.
+{
+    profile_unwind(0);
+    profiling = false;
+    return cell();
+}
+
+static bool by_exclusive_time(const profile_function &a, const profile_function &b)
+{
+    return a.exclusive_ns > b.exclusive_ns;
+}
+
+cell proc_profile_report(const cell &_)
+{
+    std::vector<profile_function> sorted(functions);
+    std::sort(sorted.begin(), sorted.end(), by_exclusive_time);
+    long long total_ns = 0;
+    for (size_t i = 0; i < sorted.size(); i++)
+        total_ns += sorted[i].exclusive_ns;
+    flush_console();
+    std::cout << std::left << std::setw(24) << "function" << std::right << std::setw(10) << "calls"
+              << std::setw(12) << "incl ms" << std::setw(12) << "excl ms" << std::setw(8) << "excl%"
+              << std::setw(13) << "incl allocs" << std::setw(13) << "excl allocs" << "\n";
+    std::ios::fmtflags flags = std::cout.flags();
+    std::streamsize precision = std::cout.precision();
+    std::cout << std::fixed;
+    for (size_t i = 0; i < sorted.size(); i++)
+    {
+        const profile_function &f = sorted[i];
+        std::cout << std::left << std::setw(24) << f.name << std::right << std::setw(10) << f.calls
+                  << std::setprecision(3) << std::setw(12) << f.inclusive_ns / 1e6 << std::setw(12) << f.exclusive_ns / 1e6
+                  << std::setprecision(1) << std::setw(8) << (total_ns? 100.0 * f.exclusive_ns / total_ns : 0.0)
+                  << std::setw(13) << f.inclusive_allocs << std::setw(13) << f.exclusive_allocs << "\n";
+    }
+    std::cout.flags(flags);
+    std::cout.precision(precision);
+    return cell();
+}
+
+cell proc_profile_folded(const cell &arglist)   //(profile-folded "file"): returns how many stacks were written.
+{
+    cell path;
+    if (arglist.car())
+        path = proc_eval(*arglist.car());
+    if (pending_go)
+        return cell();
+    if (path.type != v_string)
+        throw(exception("Error: expected file name as argument to profile-folded."));
+    std::ofstream out(*path.str);
+    if (!out)
+        throw(exception("Error: couldn't open " + *path.str + " for writing."));
+    long long lines = 0;
+    std::string stack;
+    std::vector<std::pair<int, size_t> > pending;      //node, and the length of its parent's path - walked without recursion, as the tree is as deep as the calls were.
+    for (size_t i = nodes.empty()? 0 : nodes[0].children.size(); i-- > 0;)
+        pending.push_back(std::make_pair(nodes[0].children[i], (size_t)0));
+    while (!pending.empty())
+    {
+        const profile_node &node = nodes[pending.back().first];
+        stack.resize(pending.back().second);
+        pending.pop_back();
+        if (!stack.empty())
+            stack += ";";
+        stack += functions[node.function].name;
+        if (node.self_ns > 0)
+        {
+            out << stack << " " << node.self_ns << "\n";
+            lines++;
+        }
+        for (size_t i = node.children.size(); i-- > 0;)
+            pending.push_back(std::make_pair(node.children[i], stack.size()));
+    }
+    if (!out)
+        throw(exception("Error: couldn't write " + *path.str + "."));
+    return cell(lines);
+}
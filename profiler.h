@@ -0,0 +1,44 @@
+#ifndef PROFILER_H_INCLUDED
+#define PROFILER_H_INCLUDED
+
+#include <cstddef>
+
+#include "parser.h"
+
+// Instrumenting profiler. While it's on, both evaluators report each call to
+// an interpreted function, each run of a macro call's expansion, and each
+// native they call out to. It keeps call counts, inclusive and exclusive time
+// and allocations per name, and a call tree that PROFILE-FOLDED writes out
+// as folded stacks (one "A;B;C <ns>" line per path) for flamegraph.pl.
+// Closures are named after the global they were first defined as.
+
+extern thread_local bool profiling;
+
+void profile_enter(const cell &callee);     //a function, macro or native, about to run.
+void profile_exit();                        //the innermost call has returned.
+size_t profile_depth();
+void profile_unwind(size_t depth);          //exit everything entered since the stack was this deep - for errors and go's.
+
+struct profile_scope        //a C++ scope that enters calls: whatever way it's left, they're exited.
+{
+    size_t depth;           //the stack depth to go back to, once something has been entered
+    bool entered;
+    profile_scope() : depth(0), entered(false) {}
+    void enter(const cell &callee)      //a tail call replaces what this scope entered before.
+    {
+        if (entered)
+            profile_unwind(depth);
+        else
+            depth = profile_depth();
+        entered = true;
+        profile_enter(callee);
+    }
+    ~profile_scope() {if (entered) profile_unwind(depth);}
+};
+
+cell proc_profile_start(const cell &_);
+cell proc_profile_stop(const cell &_);
+cell proc_profile_report(const cell &_);
+cell proc_profile_folded(const cell &arglist);
+
+#endif // PROFILER_H_INCLUDED
@@ -0,0 +1,288 @@
+#include <string>
+#include <vector>
+
+#include "sequence.h"
+#include "proc.h"
+#include "heap.h"
+#include "vector.h"
+
+struct sequence             //reads the items of a list, vector or double vector in order.
+{
+    cell seq;
+    const cell *iter;
+    size_t i, length;
+    sequence(const cell &c, const std::string &name);
+    bool next(cell &item);
+};
+
+sequence::sequence(const cell &c, const std::string &name) : seq(c), iter(0), i(0), length(0)
+{
+    if (c.type == v_list)
+        iter = &seq;
+    else if (c.type == v_vector)
+        length = c.vec->length;
+    else if (c.type == v_double_vector)
+        length = c.dvec->length;
+    else if (!(c == cell()))
+        throw(exception("Error: expected list or vector as argument to " + name + "."));
+}
+
+bool sequence::next(cell &item)
+{
+    if (seq.type == v_list)
+    {
+        if (!iter || !iter->car())
+            return false;
+        item = *iter->car();
+        iter = iter->cdr();
+        return true;
+    }
+    if (i == length)
+        return false;
+    item = seq.type == v_vector? seq.vec->items[i] : cell(seq.dvec->items[i]);
+    i++;
+    return true;
+}
+
+struct list_builder         //appends at the tail, so a result comes out in order without reversing it.
+{
+    cell head;
+    cell *tail;
+    list_builder() : head(v_list), tail(&head) {}
+    void push(const cell &x)
+    {
+        *tail = cell(x, cell(v_list));
+        tail = tail->cdr();
+    }
+};
+
+static bool is_vector(const cell &c)
+{
+    return c.type == v_vector || c.type == v_double_vector;
+}
+
+static cell map_one(const cell &fn, const cell &c)
+{
+    sequence seq(c, "mapcar");
+    cell item;
+    if (is_vector(c))
+    {
+        cell result(v_vector);                  //fn can return anything, so even a double vector maps to a plain one.
+        result.vec = make_vector(seq.length);
+        for (size_t i = 0; seq.next(item); i++)
+        {
+            cell value = apply_function(fn, &item, 1);
+            if (pending_go)
+                return cell();
+            result.vec->items[i] = value;
+        }
+        return result;
+    }
+    list_builder result;
+    while (seq.next(item))
+    {
+        cell value = apply_function(fn, &item, 1);
+        if (pending_go)
+            return cell();
+        result.push(value);
+    }
+    return result.head;
+}
+
+cell prim_mapcar(const cell *args, int n)      //(mapcar fn seq...): fn on the first item of each, then the second, until the shortest runs out. A vector if the first is one.
+{
+    if (n == 2)
+        return map_one(args[0], args[1]);
+    std::vector<sequence> seqs;
+    seqs.reserve(n - 1);                        //no reallocation: a list sequence points into itself.
+    for (int i = 1; i < n; i++)
+        seqs.emplace_back(args[i], "mapcar");
+    cell *items = make_vector(n - 1)->items;   //on the heap, where the collector sees them.
+    list_builder result;
+    size_t count = 0;
+    while (true)
+    {
+        for (int i = 0; i < n - 1; i++)
+        {
+            if (seqs[i].next(items[i]))
+                continue;
+            if (!is_vector(args[1]))
+                return result.head;
+            cell mapped(v_vector);
+            mapped.vec = make_vector(count);
+            size_t j = 0;
+            for (const cell *iter = &result.head; iter && iter->car(); iter = iter->cdr())
+                mapped.vec->items[j++] = *iter->car();
+            return mapped;
+        }
+        cell value = apply_function(args[0], items, n - 1);
+        if (pending_go)
+            return cell();
+        result.push(value);
+        count++;
+    }
+}
+
+cell prim_reduce(const cell *args, int n)      //(reduce fn seq [initial]): without initial, starts from the first item, and gives (fn) for an empty sequence.
+{
+    sequence seq(args[1], "reduce");
+    cell operands[2];
+    if (n > 2)
+        operands[0] = args[2];
+    if (n < 3 && !seq.next(operands[0]))
+        return apply_function(args[0], operands, 0);
+    while (seq.next(operands[1]))
+    {
+        operands[0] = apply_function(args[0], operands, 2);
+        if (pending_go)
+            return cell();
+    }
+    return operands[0];
+}
+
+static cell keep_if(const cell *args, bool keep, const std::string &name)     //the items for which (pred item) is keep, in a sequence like the one given.
+{
+    sequence seq(args[1], name);
+    list_builder kept;
+    size_t count = 0;
+    cell item;
+    while (seq.next(item))
+    {
+        cell test = apply_function(args[0], &item, 1);
+        if (pending_go)
+            return cell();
+        if (!(test == cell()) == keep)
+        {
+            kept.push(item);
+            count++;
+        }
+    }
+    if (!is_vector(args[1]))
+        return kept.head;
+    cell result(args[1].type);
+    if (args[1].type == v_vector)
+        result.vec = make_vector(count);
+    else
+        result.dvec = make_double_vector(count);
+    size_t i = 0;
+    for (const cell *iter = &kept.head; iter && iter->car(); iter = iter->cdr(), i++)
+    {
+        if (result.type == v_vector)
+            result.vec->items[i] = *iter->car();
+        else
+            result.dvec->items[i] = iter->car()->n;
+    }
+    return result;
+}
+
+cell prim_remove_if(const cell *args, int n)   //(remove-if pred seq)
+{
+    return keep_if(args, false, "remove-if");
+}
+
+cell prim_filter(const cell *args, int n)      //(filter pred seq): the opposite of remove-if.
+{
+    return keep_if(args, true, "filter");
+}
+
+cell prim_find(const cell *args, int n)        //(find item seq): the first item = to the one given, or NIL.
+{
+    sequence seq(args[1], "find");
+    cell item;
+    while (seq.next(item))
+        if (item == args[0])
+            return item;
+    return cell();
+}
+
+cell prim_find_if(const cell *args, int n)     //(find-if pred seq)
+{
+    sequence seq(args[1], "find-if");
+    cell item;
+    while (seq.next(item))
+    {
+        cell test = apply_function(args[0], &item, 1);
+        if (pending_go)
+            return cell();
+        if (!(test == cell()))
+            return item;
+    }
+    return cell();
+}
+
+cell prim_every(const cell *args, int n)       //(every pred seq): T if pred holds for every item, stopping at the first it doesn't.
+{
+    sequence seq(args[1], "every");
+    cell item;
+    while (seq.next(item))
+    {
+        cell test = apply_function(args[0], &item, 1);
+        if (pending_go || test == cell())
+            return cell();
+    }
+    return cell(&sym_true);
+}
+
+cell prim_some(const cell *args, int n)        //(some pred seq): the first true value of pred, or NIL.
+{
+    sequence seq(args[1], "some");
+    cell item;
+    while (seq.next(item))
+    {
+        cell test = apply_function(args[0], &item, 1);
+        if (pending_go)
+            return cell();
+        if (!(test == cell()))
+            return test;
+    }
+    return cell();
+}
+
+cell prim_append(const cell *args, int n)      //(append seq ... list): copies every argument but the last, which the result ends in.
+{
+    list_builder result;
+    for (int i = 0; i < n; i++)
+    {
+        if (i == n - 1 && args[i].type == v_list)
+        {
+            *result.tail = args[i];
+            break;
+        }
+        sequence items(args[i], "append");
+        cell item;
+        while (items.next(item))
+            result.push(item);
+    }
+    return result.head;
+}
+
+cell prim_length(const cell *args, int n)
+{
+    const cell &seq = args[0];
+    if (seq.type == v_string)
+        return cell((long long)seq.str->size());
+    if (is_vector(seq))
+        return vector_length(seq);
+    if (seq == cell())
+        return cell(0LL);
+    if (seq.type != v_list)
+        throw(exception("Error: expected sequence as argument to length."));
+    long long length = 0;
+    for (const cell *iter = &seq; iter && iter->car(); iter = iter->cdr())
+        length++;
+    return cell(length);
+}
+
+cell prim_nth(const cell *args, int n)         //(nth n seq): NIL past the end.
+{
+    if (args[0].type != v_fixnum || args[0].i < 0)
+        throw(exception("Error: expected non-negative integer index to nth."));
+    if (is_vector(args[1]))
+        return args[0].i < vector_length(args[1]).i? vector_ref(args[1], args[0]) : cell();
+    sequence seq(args[1], "nth");
+    cell item;
+    for (long long i = 0; seq.next(item); i++)
+        if (i == args[0].i)
+            return item;
+    return cell();
+}
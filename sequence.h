@@ -0,0 +1,23 @@
+#ifndef SEQUENCE_H_INCLUDED
+#define SEQUENCE_H_INCLUDED
+
+#include "parser.h"
+
+// Sequence functions over lists, vectors and double vectors. Each walks its
+// sequence once, calls any function it was given through apply_function,
+// and builds a result list front to back as it goes. Mapping or filtering
+// a vector gives a vector back; everything else gives a list.
+
+cell prim_mapcar(const cell *args, int n);
+cell prim_reduce(const cell *args, int n);
+cell prim_remove_if(const cell *args, int n);
+cell prim_filter(const cell *args, int n);
+cell prim_find(const cell *args, int n);
+cell prim_find_if(const cell *args, int n);
+cell prim_every(const cell *args, int n);
+cell prim_some(const cell *args, int n);
+cell prim_append(const cell *args, int n);
+cell prim_length(const cell *args, int n);
+cell prim_nth(const cell *args, int n);
+
+#endif // SEQUENCE_H_INCLUDED
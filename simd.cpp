@@ -0,0 +1,375 @@
+#include <cstdlib>
+#include <cstring>
+
+#include "simd.h"
+
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(LISP_NO_SIMD)
+#define SIMD_X86 1
+#include <immintrin.h>
+#else
+#define SIMD_X86 0
+#endif
+
+
+// Plain C++: the fallback, and the tails the vector versions leave over.
+
+static inline double apply(simd_op op, double a, double b)
+{
+    switch (op)
+    {
+        case simd_add:
+            return a + b;
+        case simd_subtract:
+            return a - b;
+        case simd_multiply:
+            return a * b;
+        default:
+            return a / b;
+    }
+}
+
+static inline double min2(double a, double b) {return a < b? a : b;}     //the same choice minpd makes, NaNs included.
+static inline double max2(double a, double b) {return a > b? a : b;}
+
+static void map_scalar(simd_op op, const double *a, const double *b, double *out, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        out[i] = apply(op, a[i], b[i]);
+}
+
+static void map_scalar_scalar(simd_op op, const double *a, double b, double *out, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        out[i] = apply(op, a[i], b);
+}
+
+static double sum_scalar(const double *a, size_t n)
+{
+    double total = 0;
+    for (size_t i = 0; i < n; i++)
+        total += a[i];
+    return total;
+}
+
+static double dot_scalar(const double *a, const double *b, size_t n)
+{
+    double total = 0;
+    for (size_t i = 0; i < n; i++)
+        total += a[i] * b[i];
+    return total;
+}
+
+static double min_scalar(const double *a, size_t n)
+{
+    double m = a[0];
+    for (size_t i = 1; i < n; i++)
+        m = min2(m, a[i]);
+    return m;
+}
+
+static double max_scalar(const double *a, size_t n)
+{
+    double m = a[0];
+    for (size_t i = 1; i < n; i++)
+        m = max2(m, a[i]);
+    return m;
+}
+
+#define MAP_LOOP(width, load, store, fn) \
+    for (; i + width <= n; i += width) \
+        store(out + i, fn(load(a + i), load(b + i)))
+
+#define MAP_SCALAR_LOOP(width, load, store, fn) \
+    for (; i + width <= n; i += width) \
+        store(out + i, fn(load(a + i), k))
+
+#if SIMD_X86
+
+// SSE2: part of x86-64, so always there.
+
+static void map_sse2(simd_op op, const double *a, const double *b, double *out, size_t n)
+{
+    size_t i = 0;
+    switch (op)
+    {
+        case simd_add:
+            MAP_LOOP(2, _mm_loadu_pd, _mm_storeu_pd, _mm_add_pd);
+            break;
+        case simd_subtract:
+            MAP_LOOP(2, _mm_loadu_pd, _mm_storeu_pd, _mm_sub_pd);
+            break;
+        case simd_multiply:
+            MAP_LOOP(2, _mm_loadu_pd, _mm_storeu_pd, _mm_mul_pd);
+            break;
+        case simd_divide:
+            MAP_LOOP(2, _mm_loadu_pd, _mm_storeu_pd, _mm_div_pd);
+            break;
+    }
+    map_scalar(op, a + i, b + i, out + i, n - i);
+}
+
+static void map_scalar_sse2(simd_op op, const double *a, double b, double *out, size_t n)
+{
+    size_t i = 0;
+    __m128d k = _mm_set1_pd(b);
+    switch (op)
+    {
+        case simd_add:
+            MAP_SCALAR_LOOP(2, _mm_loadu_pd, _mm_storeu_pd, _mm_add_pd);
+            break;
+        case simd_subtract:
+            MAP_SCALAR_LOOP(2, _mm_loadu_pd, _mm_storeu_pd, _mm_sub_pd);
+            break;
+        case simd_multiply:
+            MAP_SCALAR_LOOP(2, _mm_loadu_pd, _mm_storeu_pd, _mm_mul_pd);
+            break;
+        case simd_divide:
+            MAP_SCALAR_LOOP(2, _mm_loadu_pd, _mm_storeu_pd, _mm_div_pd);
+            break;
+    }
+    map_scalar_scalar(op, a + i, b, out + i, n - i);
+}
+
+static inline double horizontal_sum(__m128d v)
+{
+    return _mm_cvtsd_f64(_mm_add_sd(v, _mm_unpackhi_pd(v, v)));
+}
+
+static double sum_sse2(const double *a, size_t n)
+{
+    __m128d s0 = _mm_setzero_pd(), s1 = _mm_setzero_pd();      //two chains, so each add needn't wait on the last.
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        s0 = _mm_add_pd(s0, _mm_loadu_pd(a + i));
+        s1 = _mm_add_pd(s1, _mm_loadu_pd(a + i + 2));
+    }
+    return horizontal_sum(_mm_add_pd(s0, s1)) + sum_scalar(a + i, n - i);
+}
+
+static double dot_sse2(const double *a, const double *b, size_t n)
+{
+    __m128d s0 = _mm_setzero_pd(), s1 = _mm_setzero_pd();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        s0 = _mm_add_pd(s0, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+        s1 = _mm_add_pd(s1, _mm_mul_pd(_mm_loadu_pd(a + i + 2), _mm_loadu_pd(b + i + 2)));
+    }
+    return horizontal_sum(_mm_add_pd(s0, s1)) + dot_scalar(a + i, b + i, n - i);
+}
+
+static double min_sse2(const double *a, size_t n)
+{
+    if (n < 2)
+        return min_scalar(a, n);
+    __m128d m = _mm_loadu_pd(a);
+    size_t i = 2;
+    for (; i + 2 <= n; i += 2)
+        m = _mm_min_pd(m, _mm_loadu_pd(a + i));
+    double result = min2(_mm_cvtsd_f64(m), _mm_cvtsd_f64(_mm_unpackhi_pd(m, m)));
+    for (; i < n; i++)
+        result = min2(result, a[i]);
+    return result;
+}
+
+static double max_sse2(const double *a, size_t n)
+{
+    if (n < 2)
+        return max_scalar(a, n);
+    __m128d m = _mm_loadu_pd(a);
+    size_t i = 2;
+    for (; i + 2 <= n; i += 2)
+        m = _mm_max_pd(m, _mm_loadu_pd(a + i));
+    double result = max2(_mm_cvtsd_f64(m), _mm_cvtsd_f64(_mm_unpackhi_pd(m, m)));
+    for (; i < n; i++)
+        result = max2(result, a[i]);
+    return result;
+}
+
+
+// AVX2: four doubles at a time, where the CPU has it.
+
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static void map_avx2(simd_op op, const double *a, const double *b, double *out, size_t n)
+{
+    size_t i = 0;
+    switch (op)
+    {
+        case simd_add:
+            MAP_LOOP(4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_add_pd);
+            break;
+        case simd_subtract:
+            MAP_LOOP(4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_sub_pd);
+            break;
+        case simd_multiply:
+            MAP_LOOP(4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_mul_pd);
+            break;
+        case simd_divide:
+            MAP_LOOP(4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_div_pd);
+            break;
+    }
+    map_scalar(op, a + i, b + i, out + i, n - i);
+}
+
+AVX2 static void map_scalar_avx2(simd_op op, const double *a, double b, double *out, size_t n)
+{
+    size_t i = 0;
+    __m256d k = _mm256_set1_pd(b);
+    switch (op)
+    {
+        case simd_add:
+            MAP_SCALAR_LOOP(4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_add_pd);
+            break;
+        case simd_subtract:
+            MAP_SCALAR_LOOP(4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_sub_pd);
+            break;
+        case simd_multiply:
+            MAP_SCALAR_LOOP(4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_mul_pd);
+            break;
+        case simd_divide:
+            MAP_SCALAR_LOOP(4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_div_pd);
+            break;
+    }
+    map_scalar_scalar(op, a + i, b, out + i, n - i);
+}
+
+AVX2 static inline __m128d fold_halves_add(__m256d v)
+{
+    return _mm_add_pd(_mm256_castpd256_pd128(v), _mm256_extractf128_pd(v, 1));
+}
+
+AVX2 static double sum_avx2(const double *a, size_t n)
+{
+    __m256d s0 = _mm256_setzero_pd(), s1 = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        s0 = _mm256_add_pd(s0, _mm256_loadu_pd(a + i));
+        s1 = _mm256_add_pd(s1, _mm256_loadu_pd(a + i + 4));
+    }
+    __m128d s = fold_halves_add(_mm256_add_pd(s0, s1));
+    return _mm_cvtsd_f64(_mm_add_sd(s, _mm_unpackhi_pd(s, s))) + sum_scalar(a + i, n - i);
+}
+
+AVX2 static double dot_avx2(const double *a, const double *b, size_t n)
+{
+    __m256d s0 = _mm256_setzero_pd(), s1 = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        s0 = _mm256_add_pd(s0, _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+        s1 = _mm256_add_pd(s1, _mm256_mul_pd(_mm256_loadu_pd(a + i + 4), _mm256_loadu_pd(b + i + 4)));
+    }
+    __m128d s = fold_halves_add(_mm256_add_pd(s0, s1));
+    return _mm_cvtsd_f64(_mm_add_sd(s, _mm_unpackhi_pd(s, s))) + dot_scalar(a + i, b + i, n - i);
+}
+
+AVX2 static double min_avx2(const double *a, size_t n)
+{
+    if (n < 4)
+        return min_scalar(a, n);
+    __m256d m = _mm256_loadu_pd(a);
+    size_t i = 4;
+    for (; i + 4 <= n; i += 4)
+        m = _mm256_min_pd(m, _mm256_loadu_pd(a + i));
+    __m128d h = _mm_min_pd(_mm256_castpd256_pd128(m), _mm256_extractf128_pd(m, 1));
+    double result = min2(_mm_cvtsd_f64(h), _mm_cvtsd_f64(_mm_unpackhi_pd(h, h)));
+    for (; i < n; i++)
+        result = min2(result, a[i]);
+    return result;
+}
+
+AVX2 static double max_avx2(const double *a, size_t n)
+{
+    if (n < 4)
+        return max_scalar(a, n);
+    __m256d m = _mm256_loadu_pd(a);
+    size_t i = 4;
+    for (; i + 4 <= n; i += 4)
+        m = _mm256_max_pd(m, _mm256_loadu_pd(a + i));
+    __m128d h = _mm_max_pd(_mm256_castpd256_pd128(m), _mm256_extractf128_pd(m, 1));
+    double result = max2(_mm_cvtsd_f64(h), _mm_cvtsd_f64(_mm_unpackhi_pd(h, h)));
+    for (; i < n; i++)
+        result = max2(result, a[i]);
+    return result;
+}
+
+#endif // SIMD_X86
+
+
+// Dispatch
+
+struct simd_kernels
+{
+    const char *level;
+    void (*map)(simd_op, const double*, const double*, double*, size_t);
+    void (*map_scalar)(simd_op, const double*, double, double*, size_t);
+    double (*sum)(const double*, size_t);
+    double (*dot)(const double*, const double*, size_t);
+    double (*min)(const double*, size_t);
+    double (*max)(const double*, size_t);
+};
+
+static const simd_kernels scalar_kernels = {"scalar", map_scalar, map_scalar_scalar, sum_scalar, dot_scalar, min_scalar, max_scalar};
+#if SIMD_X86
+static const simd_kernels sse2_kernels = {"sse2", map_sse2, map_scalar_sse2, sum_sse2, dot_sse2, min_sse2, max_sse2};
+static const simd_kernels avx2_kernels = {"avx2", map_avx2, map_scalar_avx2, sum_avx2, dot_avx2, min_avx2, max_avx2};
+#endif
+
+static const simd_kernels& pick_kernels()      //CPPLISP_SIMD=sse2 or scalar in the environment settles for less, to compare them.
+{
+    const char *cap = std::getenv("CPPLISP_SIMD");
+    if (cap && !std::strcmp(cap, "scalar"))
+        return scalar_kernels;
+#if SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && !(cap && !std::strcmp(cap, "sse2")))
+        return avx2_kernels;
+    return sse2_kernels;
+#else
+    return scalar_kernels;
+#endif
+}
+
+static const simd_kernels& kernels()
+{
+    static const simd_kernels &chosen = pick_kernels();
+    return chosen;
+}
+
+void simd_map(simd_op op, const double *a, const double *b, double *out, size_t n)
+{
+    kernels().map(op, a, b, out, n);
+}
+
+void simd_map_scalar(simd_op op, const double *a, double b, double *out, size_t n)
+{
+    kernels().map_scalar(op, a, b, out, n);
+}
+
+double simd_sum(const double *a, size_t n)
+{
+    return kernels().sum(a, n);
+}
+
+double simd_dot(const double *a, const double *b, size_t n)
+{
+    return kernels().dot(a, b, n);
+}
+
+double simd_min(const double *a, size_t n)
+{
+    return kernels().min(a, n);
+}
+
+double simd_max(const double *a, size_t n)
+{
+    return kernels().max(a, n);
+}
+
+const char* simd_level()
+{
+    return kernels().level;
+}
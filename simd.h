@@ -0,0 +1,28 @@
+#ifndef SIMD_H_INCLUDED
+#define SIMD_H_INCLUDED
+
+#include <cstddef>
+
+// Bulk kernels over arrays of doubles, behind the double vector natives.
+// Each has AVX2, SSE2 and plain C++ versions, and the first call picks the
+// best the CPU has (build with CPPLISP_SIMD off for the plain ones only).
+// Sums, dot products, minima and maxima are accumulated in several lanes at
+// once, so a sum can differ from a left-to-right one in the last bits.
+
+enum simd_op
+{
+    simd_add,
+    simd_subtract,
+    simd_multiply,
+    simd_divide
+};
+
+void simd_map(simd_op op, const double *a, const double *b, double *out, size_t n);       //out[i] = a[i] op b[i]; out may be a or b.
+void simd_map_scalar(simd_op op, const double *a, double b, double *out, size_t n);       //out[i] = a[i] op b
+double simd_sum(const double *a, size_t n);
+double simd_dot(const double *a, const double *b, size_t n);
+double simd_min(const double *a, size_t n);     //n must be at least 1
+double simd_max(const double *a, size_t n);
+const char* simd_level();                       //"avx2", "sse2" or "scalar": the kernels in use.
+
+#endif // SIMD_H_INCLUDED
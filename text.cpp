@@ -0,0 +1,85 @@
+#include <string>
+
+#include "text.h"
+#include "proc.h"
+#include "heap.h"
+#include "printer.h"
+
+static const std::string& expect_string(const cell &c, const char *name)
+{
+    if (c.type != v_string)
+        throw(exception(std::string("Error: expected string as argument to ") + name + "."));
+    return *c.str;
+}
+
+static std::string* expect_builder(const cell &c, const char *name)
+{
+    if (c.type != v_string_builder)
+        throw(exception(std::string("Error: expected string builder as argument to ") + name + "."));
+    return c.str;
+}
+
+cell prim_concat(const cell *args, int n)           //(concat s...): a new string of them all, end to end.
+{
+    size_t length = 0;
+    for (int i = 0; i < n; i++)
+        length += expect_string(args[i], "concat").size();
+    std::string *result = make_string(std::string());
+    result->reserve(length);
+    for (int i = 0; i < n; i++)
+        result->append(*args[i].str);
+    return cell(v_string, result);
+}
+
+cell prim_substring(const cell *args, int n)        //(substring s start [end]): the characters from start up to but not including end.
+{
+    const std::string &s = expect_string(args[0], "substring");
+    long long end = n > 2 && args[2].type == v_fixnum? args[2].i : (long long)s.size();
+    if (args[1].type != v_fixnum || args[1].i < 0 || end < args[1].i || end > (long long)s.size() || (n > 2 && args[2].type != v_fixnum))
+        throw(exception("Error: substring out of range."));
+    return cell(v_string, s.substr(args[1].i, end - args[1].i));
+}
+
+cell prim_string_length(const cell *args, int n)    //of a string or a builder.
+{
+    if (args[0].type != v_string_builder)
+        expect_string(args[0], "string-length");
+    return cell((long long)args[0].str->size());
+}
+
+cell prim_string_to_symbol(const cell *args, int n)        //the name as it is - no upper-casing, as there is for symbols read in.
+{
+    return cell(intern(expect_string(args[0], "string->symbol")));
+}
+
+cell prim_number_to_string(const cell *args, int n)
+{
+    if (args[0].type != v_fixnum && args[0].type != v_number)
+        throw(exception("Error: expected number as argument to number->string."));
+    return cell(v_string, toString(args[0]));
+}
+
+cell prim_make_string_builder(const cell *args, int n)
+{
+    cell result(v_string_builder);
+    result.str = make_string(std::string());
+    return result;
+}
+
+cell prim_string_builder_append(const cell *args, int n)   //(string-builder-append b x...): strings go in as they are, anything else as it prints. Returns b.
+{
+    std::string *text = expect_builder(args[0], "string-builder-append");
+    for (int i = 1; i < n; i++)
+    {
+        if (args[i].type == v_string || args[i].type == v_string_builder)
+            text->append(*args[i].str);
+        else
+            text->append(toString(args[i]));
+    }
+    return args[0];
+}
+
+cell prim_string_builder_to_string(const cell *args, int n)
+{
+    return cell(v_string, *expect_builder(args[0], "string-builder->string"));
+}
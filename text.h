@@ -0,0 +1,22 @@
+#ifndef TEXT_H_INCLUDED
+#define TEXT_H_INCLUDED
+
+#include "parser.h"
+
+// Strings and string builders. A string is a std::string on the collected
+// heap that nothing changes once it's made, so a string cell is just a
+// pointer to it and copying one never copies the characters. A builder is
+// the mutable kind: the same heap object behind a v_string_builder cell,
+// appended to in place with the usual amortized growth. Taking the string
+// out of it copies it once, so the result is a string like any other.
+
+cell prim_concat(const cell *args, int n);
+cell prim_substring(const cell *args, int n);
+cell prim_string_length(const cell *args, int n);
+cell prim_string_to_symbol(const cell *args, int n);
+cell prim_number_to_string(const cell *args, int n);
+cell prim_make_string_builder(const cell *args, int n);
+cell prim_string_builder_append(const cell *args, int n);
+cell prim_string_builder_to_string(const cell *args, int n);
+
+#endif // TEXT_H_INCLUDED
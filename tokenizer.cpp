@@ -1,6 +1,4 @@
 #include <string>
-#include <vector>
-#include <map>
 #include <iostream>
 
 #include "tokenizer.h"
@@ -8,106 +6,134 @@
 token::token()
 {
     type = (token_type)0;
-    value = std::string();
 }
-token::token(token_type type_, std::string value_)
+token::token(token_type type_, std::string_view value_)
 {
     type = type_;
     value = value_;
 }
 
-typedef enum {
-    s_start = 0,
-    s_symbol,
-    s_number,
-    s_string
-} state_enum;
+struct symbol_chars
+{
+    bool allowed[256];
+    symbol_chars()
+    {
+        for (int i = 0; i < 256; i++)
+            allowed[i] = false;
+        for (int i = 'A'; i <= 'Z'; i++)
+            allowed[i] = true;
+        for (int i = 'a'; i <= 'z'; i++)
+            allowed[i] = true;
+        const char *others = "+-*/<>=!?&";
+        for (const char *c = others; *c; c++)
+            allowed[(unsigned char)*c] = true;
+    }
+};
+
+static const symbol_chars symbol_table;        //built once, not per call.
 
-std::vector<token> tokenize(std::string progstring)
+static bool is_digit(int c)
 {
-    bool characterAllowed[256];
-    for (int i = 0; i < 256; i++)
-        characterAllowed[i] = false;
+    return c >= '0' && c <= '9';
+}
+
+static bool starts_symbol(int c)
+{
+    return c >= 0 && symbol_table.allowed[c];
+}
+
+static const size_t chunk_size = 64 * 1024;
+
+lexer::lexer(std::string_view text_)
+{
+    in = 0;
+    text = text_;
+    pos = 0;
+    start = 0;
+}
+
+lexer::lexer(std::istream &in_)
+{
+    in = &in_;
+    pos = 0;
+    start = 0;
+}
 
-    for (int i = 'A'; i <= 'Z'; i++)
-        characterAllowed[i] = true;
-    for (int i = 'a'; i <= 'z'; i++)
-        characterAllowed[i] = true;
-    characterAllowed['+'] = true;
-    characterAllowed['-'] = true;
-    characterAllowed['*'] = true;
-    characterAllowed['/'] = true;
-    characterAllowed['<'] = true;
-    characterAllowed['>'] = true;
-    characterAllowed['='] = true;
-    characterAllowed['!'] = true;
-    characterAllowed['?'] = true;
-    characterAllowed['&'] = true;
+bool lexer::fill()              //append the next chunk of the stream, dropping what has been consumed. false at the end.
+{
+    if (!in || !*in)
+        return false;
+    buffer.erase(0, start);
+    pos -= start;
+    start = 0;
+    size_t old_size = buffer.size();
+    buffer.resize(old_size + chunk_size);
+    in->read(&buffer[old_size], chunk_size);
+    buffer.resize(old_size + in->gcount());
+    text = buffer;
+    return in->gcount() > 0;
+}
 
-    std::vector<token> tokens;
-    state_enum state = s_start;
-    int index = -1;
-    int regionstart;
+int lexer::peek()               //the next character, or -1 at the end of the input.
+{
+    if (pos >= text.size() && !fill())
+        return -1;
+    return (unsigned char)text[pos];
+}
 
-    while (++index <= progstring.size())
+bool lexer::next(token &t)
+{
+    while (true)
     {
-        char v = progstring.c_str()[index];
-        switch(state)
+        start = pos;
+        int v = peek();
+        if (v < 0)
+            return false;
+        pos++;
+        if (v == '(')
+            t = token(t_lparen, text.substr(start, 1));
+        else if (v == ')')
+            t = token(t_rparen, text.substr(start, 1));
+        else if (is_digit(v))
+        {
+            while (is_digit(peek()))
+                pos++;
+            t = token(t_number, text.substr(start, pos - start));
+        }
+        else if (v == ';')
+        {
+            while ((v = peek()) >= 0 && v != 10 && v != 13)
+                pos++;
+            continue;
+        }
+        else if (starts_symbol(v))
+        {
+            while (starts_symbol(peek()) || is_digit(peek()))
+                pos++;
+            t = token(t_symbol, text.substr(start, pos - start));
+        }
+        else if (v == '"')
+        {
+            while ((v = peek()) >= 0 && v != '"')
+                pos++;
+            if (v < 0)
+                return false;                   //unterminated - nothing more to read.
+            pos++;
+            t = token(t_string, text.substr(start + 1, pos - start - 2));
+        }
+        else if (v == '#' && peek() == '(')
+        {
+            pos++;
+            t = token(t_vector, text.substr(start, 2));
+        }
+        else if (v == '\'' || v == '`' || v == ',')     //quote, backquote, comma
         {
-            case s_start:
-                regionstart = index;
-                if (v == '(')
-                    tokens.push_back(token(t_lparen, "("));
-                else if (v == ')')
-                    tokens.push_back(token(t_rparen, ")"));
-                else if (v >= '0' && v <= '9')
-                    state = s_number;
-                else if (v == ';')
-                    while (++index < progstring.size() && progstring.c_str()[index] != 10 && progstring.c_str()[index] != 13);
-                else if (characterAllowed[v])
-                    state = s_symbol;
-                else if (v == '"')
-                    state = s_string;
-                else if (v == '\'' || v == '`' || v == ',')     //quote, backquote, comma
-                {
-                    if (v == ',' && index < progstring.size() && progstring.c_str()[index + 1] == '@')
-                    {
-                        tokens.push_back(token(t_quote, ",@"));
-                        index++;
-                    }
-                    else
-                    {
-                        char str[2];
-                        str[0] = v;
-                        str[1] = 0;
-                        tokens.push_back(token(t_quote, str));
-                    }
-                }
-            break;
-            case s_number:
-                if (v < '0' || v > '9')
-                {
-                    tokens.push_back(token(t_number, progstring.substr(regionstart, index - regionstart)));
-                    index--;
-                    state = s_start;
-                }
-            break;
-            case s_symbol:
-                if (!(characterAllowed[v] || (v >= '0' && v <= '9')))
-                {
-                    tokens.push_back(token(t_symbol, progstring.substr(regionstart, index - regionstart)));
-                    --index;
-                    state = s_start;
-                }
-            break;
-            case s_string:
-                if (v == '"')
-                {
-                    tokens.push_back(token(t_string, progstring.substr(regionstart + 1, index - regionstart - 1)));
-                    state = s_start;
-                }
-            break;
+            if (v == ',' && peek() == '@')
+                pos++;
+            t = token(t_quote, text.substr(start, pos - start));
         }
+        else
+            continue;                           //whitespace, or anything else we don't know
+        return true;
     }
-    return tokens;
 }
@@ -2,7 +2,8 @@
 #define _TOKENIZER_H_INCLUDED_
 
 #include <string>
-#include <vector>
+#include <string_view>
+#include <istream>
 
 typedef enum
 {
@@ -11,18 +12,35 @@ typedef enum
     t_symbol,
     t_number,
     t_string,
-    t_quote
+    t_quote,
+    t_vector                        //#( - the rest reads like a list
 } token_type;
 
 struct token
 {
     token_type type;
-    std::string value;
+    std::string_view value;         //a slice of the lexer's buffer: only good until the lexer is next asked for a token.
     token();
-    token(token_type type_, std::string value_);
+    token(token_type type_, std::string_view value_);
 };
 
-std::vector<token> tokenize(std::string progstring);
+class lexer                         //hands out one token at a time, as the parser asks for them.
+{
+    private:
+    std::istream *in;               //null when scanning a buffer the caller owns
+    std::string buffer;             //read from the stream and not yet consumed
+    std::string_view text;
+    size_t pos;
+    size_t start;                   //first character of the token being scanned, which a refill keeps.
+
+    bool fill();
+    int peek();
+
+    public:
+    lexer(std::string_view text_);  //the text must outlive the lexer - a string, or a file mapped into memory.
+    lexer(std::istream &in_);       //reads the stream a chunk at a time.
+    bool next(token &t);            //false at the end of the input.
+};
 
 
 #endif // _TOKENIZER_H_INCLUDED_
@@ -0,0 +1,293 @@
+#include <string>
+
+#include "vector.h"
+#include "proc.h"
+#include "heap.h"
+#include "simd.h"
+
+static size_t checked_index(const cell &index, size_t length, const std::string &name)
+{
+    if (index.type != v_fixnum)
+        throw(exception("Error: expected integer index to " + name + "."));
+    if (index.i < 0 || (unsigned long long)index.i >= length)
+        throw(exception("Error: vector index out of range (" + name + ")."));
+    return (size_t)index.i;
+}
+
+static double checked_double(const cell &value)
+{
+    if (value.type == v_fixnum)
+        return (double)value.i;
+    if (value.type != v_number)
+        throw(exception("Error: double vectors can only hold numbers."));
+    return value.n;
+}
+
+static size_t checked_length(const cell &n, const std::string &name)
+{
+    if (n.type != v_fixnum || n.i < 0)
+        throw(exception("Error: expected length as first argument to " + name + "."));
+    return (size_t)n.i;
+}
+
+static size_t list_length(const cell &list, const std::string &name)
+{
+    if (list.type != v_list)
+        throw(exception("Error: expected list as argument to " + name + "."));
+    size_t n = 0;
+    for (const cell *iter = &list; iter && iter->car(); iter = iter->cdr())
+        n++;
+    return n;
+}
+
+cell vector_ref(const cell &v, const cell &index)
+{
+    if (v.type == v_vector)
+        return v.vec->items[checked_index(index, v.vec->length, "vector-ref")];
+    if (v.type == v_double_vector)
+        return cell(v.dvec->items[checked_index(index, v.dvec->length, "vector-ref")]);
+    throw(exception("Error: expected vector as argument to vector-ref."));
+}
+
+cell vector_set(const cell &v, const cell &index, const cell &value)
+{
+    if (v.type == v_vector)
+        v.vec->items[checked_index(index, v.vec->length, "vector-set!")] = value;
+    else if (v.type == v_double_vector)
+        v.dvec->items[checked_index(index, v.dvec->length, "vector-set!")] = checked_double(value);
+    else
+        throw(exception("Error: expected vector as argument to vector-set!."));
+    return value;
+}
+
+cell vector_length(const cell &v)
+{
+    if (v.type == v_vector)
+        return cell((long long)v.vec->length);
+    if (v.type == v_double_vector)
+        return cell((long long)v.dvec->length);
+    throw(exception("Error: expected vector as argument to vector-length."));
+}
+
+cell proc_make_vector(const cell &arglist)         //(make-vector n [init])
+{
+    cell args[2];
+    if (!eval_args(arglist, args, 2))
+        return cell();
+    size_t n = checked_length(args[0], "make-vector");
+    cell result(v_vector);
+    result.vec = make_vector(n);
+    for (size_t i = 0; i < n; i++)
+        result.vec->items[i] = args[1];
+    return result;
+}
+
+cell proc_make_double_vector(const cell &arglist)  //(make-double-vector n [init]): zeros unless told otherwise.
+{
+    cell args[2];
+    if (!eval_args(arglist, args, 2))
+        return cell();
+    size_t n = checked_length(args[0], "make-double-vector");
+    double init = args[1] == cell()? 0.0 : checked_double(args[1]);
+    cell result(v_double_vector);
+    result.dvec = make_double_vector(n);
+    for (size_t i = 0; i < n; i++)
+        result.dvec->items[i] = init;
+    return result;
+}
+
+cell proc_vector_ref(const cell &arglist)
+{
+    cell args[2];
+    if (!eval_args(arglist, args, 2))
+        return cell();
+    return vector_ref(args[0], args[1]);
+}
+
+cell proc_vector_set(const cell &arglist)          //(vector-set! v i x)
+{
+    cell args[3];
+    if (!eval_args(arglist, args, 3))
+        return cell();
+    return vector_set(args[0], args[1], args[2]);
+}
+
+cell proc_vector_length(const cell &arglist)
+{
+    cell v;
+    if (!eval_args(arglist, &v, 1))
+        return cell();
+    return vector_length(v);
+}
+
+cell proc_vector_to_list(const cell &arglist)
+{
+    cell v;
+    if (!eval_args(arglist, &v, 1))
+        return cell();
+    cell result(v_list);
+    if (v.type == v_vector)
+    {
+        for (size_t i = v.vec->length; i-- > 0;)
+            result = cell(v.vec->items[i], result);
+    }
+    else if (v.type == v_double_vector)
+    {
+        for (size_t i = v.dvec->length; i-- > 0;)
+            result = cell(cell(v.dvec->items[i]), result);
+    }
+    else
+        throw(exception("Error: expected vector as argument to vector->list."));
+    return result;
+}
+
+cell proc_list_to_vector(const cell &arglist)
+{
+    cell list;
+    if (!eval_args(arglist, &list, 1))
+        return cell();
+    cell result(v_vector);
+    result.vec = make_vector(list_length(list, "list->vector"));
+    size_t i = 0;
+    for (const cell *iter = &list; iter && iter->car(); iter = iter->cdr())
+        result.vec->items[i++] = *iter->car();
+    return result;
+}
+
+cell proc_list_to_double_vector(const cell &arglist)
+{
+    cell list;
+    if (!eval_args(arglist, &list, 1))
+        return cell();
+    cell result(v_double_vector);
+    result.dvec = make_double_vector(list_length(list, "list->double-vector"));
+    size_t i = 0;
+    for (const cell *iter = &list; iter && iter->car(); iter = iter->cdr())
+        result.dvec->items[i++] = checked_double(*iter->car());
+    return result;
+}
+
+
+// Bulk arithmetic over double vectors. The elementwise ones take a vector
+// or a number as their second operand, and an optional vector to write the
+// result into (which may be one of the operands) instead of a new one.
+
+static double_vector* expect_double_vector(const cell &c, const std::string &name)
+{
+    if (c.type != v_double_vector)
+        throw(exception("Error: expected double vector as argument to " + name + "."));
+    return c.dvec;
+}
+
+static cell bulk_map(simd_op op, const cell &arglist, const std::string &name)
+{
+    cell args[3];
+    if (!eval_args(arglist, args, 3))
+        return cell();
+    double_vector *a = expect_double_vector(args[0], name);
+    cell result = args[2];
+    if (result == cell())
+    {
+        result = cell(v_double_vector);
+        result.dvec = make_double_vector(a->length);
+    }
+    else if (expect_double_vector(result, name)->length != a->length)
+        throw(exception("Error: vectors of different lengths given to " + name + "."));
+    if (args[1].type == v_double_vector)
+    {
+        if (args[1].dvec->length != a->length)
+            throw(exception("Error: vectors of different lengths given to " + name + "."));
+        simd_map(op, a->items, args[1].dvec->items, result.dvec->items, a->length);
+    }
+    else
+        simd_map_scalar(op, a->items, checked_double(args[1]), result.dvec->items, a->length);
+    return result;
+}
+
+cell proc_vector_add(const cell &arglist)          //(vector-add a b [out])
+{
+    return bulk_map(simd_add, arglist, "vector-add");
+}
+
+cell proc_vector_subtract(const cell &arglist)
+{
+    return bulk_map(simd_subtract, arglist, "vector-sub");
+}
+
+cell proc_vector_multiply(const cell &arglist)
+{
+    return bulk_map(simd_multiply, arglist, "vector-mul");
+}
+
+cell proc_vector_divide(const cell &arglist)
+{
+    return bulk_map(simd_divide, arglist, "vector-div");
+}
+
+cell proc_vector_scale(const cell &arglist)        //(vector-scale a k [out])
+{
+    if (arglist.cdr() && arglist.cdr()->car() && arglist.cdr()->car()->type == v_double_vector)
+        throw(exception("Error: expected number as scale factor to vector-scale."));
+    return bulk_map(simd_multiply, arglist, "vector-scale");
+}
+
+cell proc_vector_map(const cell &arglist)          //(vector-map op a b [out]): op is one of + - * /, whose kernel is run over the lot.
+{
+    cell op;
+    if (!eval_args(arglist, &op, 1))
+        return cell();
+    const cell rest = arglist.cdr()? *arglist.cdr() : cell(v_list);
+    if (op.type == v_primitive && op.prim->fn == prim_add)
+        return bulk_map(simd_add, rest, "vector-map");
+    if (op.type == v_primitive && op.prim->fn == prim_subtract)
+        return bulk_map(simd_subtract, rest, "vector-map");
+    if (op.type == v_primitive && op.prim->fn == prim_multiply)
+        return bulk_map(simd_multiply, rest, "vector-map");
+    if (op.type == v_primitive && op.prim->fn == prim_divide)
+        return bulk_map(simd_divide, rest, "vector-map");
+    throw(exception("Error: vector-map needs one of + - * / as its operation."));
+}
+
+cell proc_vector_sum(const cell &arglist)
+{
+    cell v;
+    if (!eval_args(arglist, &v, 1))
+        return cell();
+    double_vector *a = expect_double_vector(v, "vector-sum");
+    return cell(simd_sum(a->items, a->length));
+}
+
+cell proc_vector_min(const cell &arglist)          //NIL for an empty vector.
+{
+    cell v;
+    if (!eval_args(arglist, &v, 1))
+        return cell();
+    double_vector *a = expect_double_vector(v, "vector-min");
+    return a->length? cell(simd_min(a->items, a->length)) : cell();
+}
+
+cell proc_vector_max(const cell &arglist)
+{
+    cell v;
+    if (!eval_args(arglist, &v, 1))
+        return cell();
+    double_vector *a = expect_double_vector(v, "vector-max");
+    return a->length? cell(simd_max(a->items, a->length)) : cell();
+}
+
+cell proc_dot(const cell &arglist)
+{
+    cell args[2];
+    if (!eval_args(arglist, args, 2))
+        return cell();
+    double_vector *a = expect_double_vector(args[0], "dot");
+    double_vector *b = expect_double_vector(args[1], "dot");
+    if (a->length != b->length)
+        throw(exception("Error: vectors of different lengths given to dot."));
+    return cell(simd_dot(a->items, b->items, a->length));
+}
+
+cell proc_simd_level(const cell &_)
+{
+    return cell(intern(toUpper(simd_level())));
+}
@@ -0,0 +1,52 @@
+#ifndef VECTOR_H_INCLUDED
+#define VECTOR_H_INCLUDED
+
+#include <cstddef>
+
+#include "parser.h"
+
+// Vectors: fixed-length arrays with their items inline in one heap object,
+// so indexing is a bounds check and a load. A double vector holds its
+// numbers unboxed, eight bytes each, for numeric code that wants to work
+// through them in bulk; the collector has nothing to trace inside one.
+// #(a b c) reads as a vector of the (unevaluated) items. The bulk natives
+// (vector-add, dot, vector-sum...) take double vectors and run a whole
+// vector through one of the kernels in simd.h per call.
+
+struct cell_vector          //on the collected heap; see make_vector.
+{
+    size_t length;
+    cell items[1];
+};
+
+struct double_vector
+{
+    size_t length;
+    double items[1];
+};
+
+cell vector_ref(const cell &v, const cell &index);
+cell vector_set(const cell &v, const cell &index, const cell &value);     //returns value.
+cell vector_length(const cell &v);
+
+cell proc_make_vector(const cell &arglist);
+cell proc_make_double_vector(const cell &arglist);
+cell proc_vector_ref(const cell &arglist);
+cell proc_vector_set(const cell &arglist);
+cell proc_vector_length(const cell &arglist);
+cell proc_vector_to_list(const cell &arglist);
+cell proc_list_to_vector(const cell &arglist);
+cell proc_list_to_double_vector(const cell &arglist);
+cell proc_vector_add(const cell &arglist);
+cell proc_vector_subtract(const cell &arglist);
+cell proc_vector_multiply(const cell &arglist);
+cell proc_vector_divide(const cell &arglist);
+cell proc_vector_scale(const cell &arglist);
+cell proc_vector_map(const cell &arglist);
+cell proc_vector_sum(const cell &arglist);
+cell proc_vector_min(const cell &arglist);
+cell proc_vector_max(const cell &arglist);
+cell proc_dot(const cell &arglist);
+cell proc_simd_level(const cell &_);
+
+#endif // VECTOR_H_INCLUDED
@@ -0,0 +1,1162 @@
+#include "vm.h"
+#include "proc.h"
+#include "heap.h"
+#include "analyzer.h"
+#include "profiler.h"
+#include "vector.h"
+
+#if defined(__GNUC__) && !defined(VM_NO_COMPUTED_GOTO)
+#define VM_COMPUTED_GOTO 1
+#else
+#define VM_COMPUTED_GOTO 0
+#endif
+
+extern thread_local environment *global_env;
+extern thread_local frame *env;
+
+#define VM_OPCODES(X) \
+    X(OP_HALT)          /* return top of stack from vm_run */ \
+    X(OP_RET)           /* return top of stack to the calling frame */ \
+    X(OP_NIL) \
+    X(OP_CONST)         /* k */ \
+    X(OP_LOCAL0)        /* slot */ \
+    X(OP_LOCAL1)        /* slot */ \
+    X(OP_LOCAL)         /* depth slot */ \
+    X(OP_GLOBAL)        /* k: a v_global const */ \
+    X(OP_SETLOCAL)      /* depth slot - leaves the value on the stack */ \
+    X(OP_SETGLOBAL)     /* k */ \
+    X(OP_DEFINE)        /* k - setglobal, naming a closure after it */ \
+    X(OP_POP) \
+    X(OP_POPN)          /* n */ \
+    X(OP_REPLACE)       /* drop the value under the top */ \
+    X(OP_JUMP)          /* target */ \
+    X(OP_JUMPIFNIL)     /* target - pops */ \
+    X(OP_ANDJUMP)       /* target - jumps keeping a NIL, else pops */ \
+    X(OP_ORJUMP)        /* target - jumps keeping a non-NIL, else pops */ \
+    X(OP_NOT) \
+    X(OP_CLOSURE)       /* child */ \
+    X(OP_PREPCALL)      /* k target - the callee turned out to be special: proc_eval form k instead */ \
+    X(OP_GLOBALCALL)    /* k k target - OP_GLOBAL then OP_PREPCALL, checking the usual callees first */ \
+    X(OP_CALL)          /* n */ \
+    X(OP_TAILCALL)      /* n - replaces the current frame instead of pushing one */ \
+    X(OP_LET)           /* n - pops n initial values into a new frame */ \
+    X(OP_LEAVE) \
+    X(OP_TAGBODY)       /* tagbody - pushes the result slot */ \
+    X(OP_ENDTAGBODY) \
+    X(OP_GO)            /* k: the tag, for a go that isn't lexically visible */ \
+    X(OP_CLOCK)         /* pushes the time, for time */ \
+    X(OP_TIME)          /* reports the time since the clock under the top, and drops it */ \
+    X(OP_QQSTART) \
+    X(OP_QQAPPEND) \
+    X(OP_QQSPLICE) \
+    X(OP_QQEND) \
+    X(OP_NREVERSE) \
+    X(OP_MACROCALL)     /* k: (cache head scope form) from the analyzer */ \
+    X(OP_TAILMACROCALL) /* k */ \
+    X(OP_TREEWALK)      /* k: a form to hand to proc_eval */
+
+enum opcode
+{
+#define VM_ENUM(name) name,
+    VM_OPCODES(VM_ENUM)
+#undef VM_ENUM
+    OP_NOPS
+};
+
+struct vm_frame             //a suspended caller.
+{
+    bytecode *fn;
+    const int *pc;
+    frame *env;
+    size_t base;            //stack index the callee was at
+};
+
+struct vm_handler           //an active tagbody, for go's that can't jump there directly.
+{
+    bytecode *fn;
+    int tagbody;
+    size_t nframes;
+    size_t sp;
+    frame *env;
+    size_t profile_depth;
+};
+
+static thread_local std::vector<cell> vm_stack;
+static thread_local size_t vm_top = 0;                   //stack height as of the last allocation - what the collector scans.
+static thread_local std::vector<vm_frame> vm_frames;
+static thread_local std::vector<vm_handler> vm_handlers;
+
+static void mark_vm()
+{
+    for (size_t i = 0; i < vm_top; i++)
+        gc_mark_value(vm_stack[i]);
+    for (size_t i = 0; i < vm_frames.size(); i++)
+    {
+        gc_mark_ptr(vm_frames[i].fn);
+        gc_mark_ptr(vm_frames[i].env);
+    }
+    for (size_t i = 0; i < vm_handlers.size(); i++)
+    {
+        gc_mark_ptr(vm_handlers[i].fn);
+        gc_mark_ptr(vm_handlers[i].env);
+    }
+}
+
+
+// Compiler
+
+struct tagbody_scope
+{
+    int index;
+    int depth;
+    int let_depth;
+    int handler_depth;
+};
+
+struct go_fixup
+{
+    size_t op;
+    int tagbody;
+    symbol *tag;
+};
+
+struct compiler
+{
+    bytecode *fn;
+    int depth;
+    int let_depth;
+    int handler_depth;
+    std::vector<tagbody_scope> tagbodies;
+    std::vector<go_fixup> fixups;
+
+    compiler(bytecode *fn_) {fn = fn_; depth = 0; let_depth = 0; handler_depth = 0;}
+
+    size_t here() {return fn->ops.size();}
+    void emit(int op) {fn->ops.push_back(op);}
+    void emit(int op, int a) {emit(op); emit(a);}
+    void emit(int op, int a, int b) {emit(op); emit(a); emit(b);}
+    void emit(int op, int a, int b, int c) {emit(op); emit(a); emit(b); emit(c);}
+    int constant(const cell &x) {fn->consts.push_back(x); return fn->consts.size() - 1;}
+    void push(int n)
+    {
+        depth += n;
+        if (depth > fn->max_stack)
+            fn->max_stack = depth;
+    }
+    void pop(int n) {depth -= n;}
+};
+
+static void compile(compiler &cc, const cell &x, bool tail = false);     //tail: the value is returned straight from the function, so calls needn't come back.
+static void compile_call(compiler &cc, const cell &x, const cell &site, bool tail);
+
+bool special_native(cell::proc_t p)
+{
+    return p == proc_quote || p == proc_quasi_quote || p == proc_if || p == proc_and || p == proc_or || p == proc_begin
+        || p == proc_define || p == proc_lambda || p == proc_macro || p == proc_macroexpand || p == proc_let
+        || p == proc_tagbody || p == proc_run_tagbody || p == proc_go || p == proc_time || p == proc_setq || p == proc_nreverse || p == proc_macro_call;
+}
+
+static bool is_variable(const cell &x)
+{
+    return x.type == v_local || x.type == v_global || x.type == v_symbol;
+}
+
+static int length(const cell &list)             //-1 if the list is dotted.
+{
+    int n = 0;
+    const cell *iter = &list;
+    while (iter && iter->car())
+    {
+        n++;
+        iter = iter->cdr();
+    }
+    return iter && iter->type != v_list? -1 : n;
+}
+
+static void compile_body(compiler &cc, const cell *iter, bool tail = false)
+{
+    if (!iter || !iter->car())
+    {
+        cc.emit(OP_NIL);
+        cc.push(1);
+        return;
+    }
+    while (iter && iter->car())
+    {
+        const cell &form = *iter->car();
+        iter = iter->cdr();
+        compile(cc, form, tail && !(iter && iter->car()));
+        if (iter && iter->car())
+        {
+            cc.emit(OP_POP);
+            cc.pop(1);
+        }
+    }
+}
+
+static void compile_set(compiler &cc, const cell &ref)
+{
+    if (ref.type == v_local)
+        cc.emit(OP_SETLOCAL, ref.local.depth, ref.local.slot);
+    else if (ref.type == v_global)
+        cc.emit(OP_SETGLOBAL, cc.constant(ref));
+    else
+    {
+        cell global(v_global);
+        global.global = global_env->lookup(ref.sym);
+        cc.emit(OP_SETGLOBAL, cc.constant(global));
+    }
+}
+
+static void compile_quasi(compiler &cc, const cell &x)
+{
+    if (x.type != v_list || !x.car())
+    {
+        cc.emit(OP_CONST, cc.constant(x));
+        cc.push(1);
+        return;
+    }
+    if (x.car()->type == v_symbol && (x.car()->sym == &sym_un_quote || x.car()->sym == &sym_splice_un_quote))
+    {
+        if (x.cdr()->car())
+            compile(cc, *x.cdr()->car());
+        else
+        {
+            cc.emit(OP_NIL);
+            cc.push(1);
+        }
+        return;
+    }
+    cc.emit(OP_QQSTART);                        //head and tail of the list being built
+    cc.push(2);
+    const cell *iter = &x;
+    while (iter && iter->car())
+    {
+        const cell &item = *iter->car();
+        compile_quasi(cc, item);
+        if (item.car() && item.car()->type == v_symbol && item.car()->sym == &sym_splice_un_quote)
+            cc.emit(OP_QQSPLICE);
+        else
+            cc.emit(OP_QQAPPEND);
+        cc.pop(1);
+        iter = iter->cdr();
+    }
+    cc.emit(OP_QQEND);
+    cc.pop(1);
+}
+
+static bytecode* compile_function(const cell &args, const cell &body, size_t nslots);
+
+static bool compile_special(compiler &cc, const cell &x, cell::proc_t form, bool tail)
+{
+    const cell &args = *x.cdr();
+    if (form == proc_quote)
+    {
+        if (args.car())
+            cc.emit(OP_CONST, cc.constant(*args.car()));
+        else
+            cc.emit(OP_NIL);
+        cc.push(1);
+    }
+    else if (form == proc_quasi_quote)
+    {
+        if (args.car())
+            compile_quasi(cc, *args.car());
+        else
+        {
+            cc.emit(OP_NIL);
+            cc.push(1);
+        }
+    }
+    else if (form == proc_if)
+    {
+        if (!args.car())
+        {
+            cc.emit(OP_NIL);
+            cc.push(1);
+            return true;
+        }
+        compile(cc, *args.car());
+        const cell *branches = args.cdr();
+        if (!branches->car())
+        {
+            cc.emit(OP_POP);
+            cc.emit(OP_NIL);
+            return true;
+        }
+        cc.emit(OP_JUMPIFNIL, 0);
+        cc.pop(1);
+        size_t else_fixup = cc.here() - 1;
+        compile(cc, *branches->car(), tail);
+        cc.emit(OP_JUMP, 0);
+        size_t end_fixup = cc.here() - 1;
+        cc.pop(1);
+        cc.fn->ops[else_fixup] = cc.here();
+        if (branches->cdr()->car())
+            compile(cc, *branches->cdr()->car(), tail);
+        else
+        {
+            cc.emit(OP_NIL);
+            cc.push(1);
+        }
+        cc.fn->ops[end_fixup] = cc.here();
+    }
+    else if (form == proc_and || form == proc_or)
+    {
+        if (!args.car())
+        {
+            cc.emit(OP_NIL);
+            cc.push(1);
+            return true;
+        }
+        std::vector<size_t> fixups;
+        const cell *iter = &args;
+        while (iter && iter->car())
+        {
+            compile(cc, *iter->car());
+            iter = iter->cdr();
+            if (iter && iter->car())
+            {
+                cc.emit(form == proc_and? OP_ANDJUMP : OP_ORJUMP, 0);
+                cc.pop(1);
+                fixups.push_back(cc.here() - 1);
+            }
+        }
+        for (size_t i = 0; i < fixups.size(); i++)
+            cc.fn->ops[fixups[i]] = cc.here();
+    }
+    else if (form == proc_begin)
+        compile_body(cc, &args, tail);
+    else if (form == proc_define)
+    {
+        if (!args.car() || !args.cdr()->car() || args.car()->type != v_symbol)
+            return false;
+        compile(cc, *args.cdr()->car());
+        cell global(v_global);                  //a raw symbol: always the global.
+        global.global = global_env->lookup(args.car()->sym);
+        cc.emit(OP_DEFINE, cc.constant(global));
+    }
+    else if (form == proc_setq)
+    {
+        if (!args.car() || !args.cdr()->car() || !is_variable(*args.car()))
+            return false;
+        compile(cc, *args.cdr()->car());
+        compile_set(cc, *args.car());
+    }
+    else if (form == proc_nreverse)
+    {
+        if (!args.car())
+            return false;
+        compile(cc, *args.car());
+        cc.emit(OP_NREVERSE);
+        if (is_variable(*args.car()))
+            compile_set(cc, *args.car());
+    }
+    else if (form == proc_lambda)
+    {
+        if (!args.car() || args.car()->type != v_list || !args.cdr()->car() || length(*args.car()) < 0)
+            return false;
+        size_t nslots = 0;
+        const cell *iter = args.car();
+        while (iter && iter->car())
+        {
+            if (iter->car()->type != v_symbol)
+                return false;
+            if (iter->car()->sym != &sym_rest)
+                nslots++;
+            iter = iter->cdr();
+        }
+        cc.fn->children.push_back(compile_function(*args.car(), *args.cdr(), nslots));
+        cc.emit(OP_CLOSURE, cc.fn->children.size() - 1);
+        cc.push(1);
+    }
+    else if (form == proc_let)
+    {
+        if (!args.car() || args.car()->type != v_list)
+            return false;
+        int n = 0;
+        const cell *iter = args.car();
+        while (iter && iter->car())
+        {
+            const cell &b = *iter->car();
+            if (b.type != v_symbol && (b.type != v_list || !b.car() || b.car()->type != v_symbol || !b.cdr()->car()))
+                return false;
+            n++;
+            iter = iter->cdr();
+        }
+        iter = args.car();
+        while (iter && iter->car())
+        {
+            if (iter->car()->type == v_symbol)
+            {
+                cc.emit(OP_NIL);
+                cc.push(1);
+            }
+            else
+                compile(cc, *iter->car()->cdr()->car());
+            iter = iter->cdr();
+        }
+        cc.emit(OP_LET, n);
+        cc.pop(n);
+        cc.let_depth++;
+        compile_body(cc, args.cdr(), tail);
+        cc.let_depth--;
+        cc.emit(OP_LEAVE);
+    }
+    else if (form == proc_run_tagbody)
+    {
+        int index = cc.fn->tagbodies.size();
+        cc.fn->tagbodies.push_back(std::map<symbol*, int>());
+        std::map<symbol*, cons*> targets;          //tag -> the expressions it starts; the table lists the last occurrence first.
+        const cell *iter = args.car();
+        while (iter && iter->car())
+        {
+            symbol *tag = iter->car()->car()->sym;
+            if (!targets.count(tag))
+            {
+                targets[tag] = iter->car()->cdr()->pair;
+                cc.fn->tagbodies[index][tag] = -1;  //known up front, so forward go's are lexical too.
+            }
+            iter = iter->cdr();
+        }
+        cc.emit(OP_TAGBODY, index);
+        cc.push(1);
+        cc.handler_depth++;
+        tagbody_scope scope = {index, cc.depth, cc.let_depth, cc.handler_depth};
+        cc.tagbodies.push_back(scope);
+        iter = args.cdr();
+        while (true)
+        {
+            cons *pos = iter? iter->pair : 0;
+            for (std::map<symbol*, cons*>::iterator t = targets.begin(); t != targets.end(); t++)
+                if (t->second == pos)
+                    cc.fn->tagbodies[index][t->first] = cc.here();
+            if (!pos)
+                break;
+            compile(cc, pos->car);
+            cc.emit(OP_REPLACE);
+            cc.pop(1);
+            iter = iter->cdr();
+        }
+        cc.tagbodies.pop_back();
+        cc.handler_depth--;
+        cc.emit(OP_ENDTAGBODY);
+    }
+    else if (form == proc_go)
+    {
+        if (!args.car() || args.car()->type != v_symbol)
+            return false;
+        symbol *tag = args.car()->sym;
+        for (size_t i = cc.tagbodies.size(); i-- > 0;)
+        {
+            tagbody_scope &scope = cc.tagbodies[i];
+            if (!cc.fn->tagbodies[scope.index].count(tag))
+                continue;
+            if (cc.depth > scope.depth)
+                cc.emit(OP_POPN, cc.depth - scope.depth);
+            for (int j = scope.let_depth; j < cc.let_depth; j++)
+                cc.emit(OP_LEAVE);
+            for (int j = scope.handler_depth; j < cc.handler_depth; j++)
+                cc.emit(OP_ENDTAGBODY);
+            cc.emit(OP_JUMP, 0);
+            go_fixup fixup = {cc.here() - 1, scope.index, tag};
+            cc.fixups.push_back(fixup);
+            cc.push(1);                         //never reached, but keeps the depth of what follows consistent
+            return true;
+        }
+        cc.emit(OP_GO, cc.constant(*args.car()));
+        cc.push(1);
+    }
+    else if (form == proc_time)
+    {
+        cc.emit(OP_CLOCK);
+        cc.push(1);
+        compile_body(cc, &args);
+        cc.emit(OP_TIME);
+        cc.pop(1);
+    }
+    else if (form == proc_macro_call)
+    {
+        const cell &callee = args.cdr()->car()->global->value;
+        if (callee.type != v_macro && callee.type != v_proc)       //a call to a function as things stand: compile it here, going back to the site if that changes.
+            compile_call(cc, *macro_call_expansion(args)->body.car(), x, tail);
+        else
+        {
+            cc.emit(tail? OP_TAILMACROCALL : OP_MACROCALL, cc.constant(args));
+            cc.push(1);
+        }
+    }
+    else
+        return false;
+    return true;
+}
+
+static void compile(compiler &cc, const cell &x, bool tail)
+{
+    switch (x.type)
+    {
+        case v_local:
+            if (x.local.depth == 0)
+                cc.emit(OP_LOCAL0, x.local.slot);
+            else if (x.local.depth == 1)
+                cc.emit(OP_LOCAL1, x.local.slot);
+            else
+                cc.emit(OP_LOCAL, x.local.depth, x.local.slot);
+            cc.push(1);
+            return;
+        case v_global:
+            cc.emit(OP_GLOBAL, cc.constant(x));
+            cc.push(1);
+            return;
+        case v_symbol:
+        {
+            cell global(v_global);
+            global.global = global_env->lookup(x.sym);
+            cc.emit(OP_GLOBAL, cc.constant(global));
+            cc.push(1);
+            return;
+        }
+        case v_list:
+            break;
+        case v_macro:
+            cc.emit(OP_TREEWALK, cc.constant(x));       //let eval report it.
+            cc.push(1);
+            return;
+        default:
+            cc.emit(OP_CONST, cc.constant(x));
+            cc.push(1);
+            return;
+    }
+
+    if (!x.car())
+    {
+        cc.emit(OP_NIL);
+        cc.push(1);
+        return;
+    }
+    const cell &head = *x.car();
+    if (head.type == v_proc && head.proc == proc_macro_call)
+    {
+        compile_special(cc, x, proc_macro_call, tail);
+        return;
+    }
+    if (head.type == v_global && head.global->value.type == v_proc && special_native(head.global->value.proc))
+    {
+        if (!compile_special(cc, x, head.global->value.proc, tail))
+        {
+            cc.emit(OP_TREEWALK, cc.constant(x));
+            cc.push(1);
+        }
+        return;
+    }
+    compile_call(cc, x, x, tail);
+}
+
+static void compile_call(compiler &cc, const cell &x, const cell &site, bool tail)     //site: what to hand to proc_eval instead if the callee turns out to be special.
+{
+    const cell &head = *x.car();
+    int n = length(*x.cdr());
+    if (n < 0)
+    {
+        cc.emit(OP_TREEWALK, cc.constant(site));
+        cc.push(1);
+        return;
+    }
+
+    if (head.type == v_global)
+    {
+        int global = cc.constant(head);
+        cc.emit(OP_GLOBALCALL, global, cc.constant(site), 0);
+        cc.push(1);
+    }
+    else
+    {
+        compile(cc, head);
+        cc.emit(OP_PREPCALL, cc.constant(x), 0);
+    }
+    size_t skip_fixup = cc.here() - 1;
+    const cell *iter = x.cdr();
+    while (iter && iter->car())
+    {
+        compile(cc, *iter->car());
+        iter = iter->cdr();
+    }
+    cc.emit(tail? OP_TAILCALL : OP_CALL, n);
+    cc.pop(n);
+    cc.fn->ops[skip_fixup] = cc.here();
+}
+
+static void finish(compiler &cc)
+{
+    for (size_t i = 0; i < cc.fixups.size(); i++)
+        cc.fn->ops[cc.fixups[i].op] = cc.fn->tagbodies[cc.fixups[i].tagbody][cc.fixups[i].tag];
+}
+
+static bytecode* compile_function(const cell &args, const cell &body, size_t nslots)
+{
+    bytecode *fn = make_bytecode();
+    fn->args = args;
+    fn->body = body;
+    fn->nslots = nslots;
+    const cell *iter = &args;
+    while (iter && iter->car())
+    {
+        if (iter->car()->type == v_symbol && iter->car()->sym == &sym_rest)
+        {
+            if (!iter->cdr()->car() || iter->cdr()->car()->type != v_symbol)
+                fn->rest = rest_unnamed;
+            else if (iter->cdr()->cdr()->car())
+                fn->rest = rest_trailing;       //names after the rest parameter can never be bound.
+            else
+                fn->rest = rest_ok;
+            break;
+        }
+        fn->nparams++;
+        iter = iter->cdr();
+    }
+    compiler cc(fn);
+    compile_body(cc, &body, true);
+    cc.emit(OP_RET);
+    finish(cc);
+    return fn;
+}
+
+static bytecode* compile_toplevel(const cell &x, int end)
+{
+    bytecode *fn = make_bytecode();
+    compiler cc(fn);
+    compile(cc, x, end == OP_RET);
+    cc.emit(end);
+    finish(cc);
+    return fn;
+}
+
+
+// Natives called from compiled code get their arguments already evaluated.
+// Primitives take them as they are, straight off the stack. The vector
+// accessors are done inline; the rest are handed an argument list of
+// quoted values, which gives the same result as their usual unevaluated one.
+
+cell call_native(cell::proc_t proc, const cell *args, int n)
+{
+    if (proc == proc_vector_ref && n == 2)
+        return vector_ref(args[0], args[1]);
+    if (proc == proc_vector_set && n == 3)
+        return vector_set(args[0], args[1], args[2]);
+
+    cell arglist(v_list);
+    for (int i = n; i-- > 0;)
+        arglist = cell(cell(cell(proc_quote), cell(args[i], cell(v_list))), arglist);
+    return proc(arglist);
+}
+
+static bytecode* compile_macro_call(const cell &node);
+
+
+// The VM itself
+
+#define IS_NIL(x) ((x).type == v_symbol && (x).sym == &sym_nil)
+#define SAVE() (vm_top = sp - stack)                //must precede anything that can allocate, so the collector sees the whole stack.
+#define RELOAD() (stack = vm_stack.data(), sp = stack + vm_top)
+
+#if VM_COMPUTED_GOTO
+#define NEXT() goto *dispatch[*pc++]
+#define CASE(name) label_##name
+#else
+#define NEXT() goto dispatch
+#define CASE(name) case name
+#endif
+
+struct vm_state_guard       //whatever way vm_run leaves, drop what it pushed.
+{
+    size_t top, nframes, nhandlers, profiled;
+    int depth;
+    vm_state_guard() {top = vm_top; nframes = vm_frames.size(); nhandlers = vm_handlers.size(); depth = eval_depth; profiled = profile_depth();}
+    ~vm_state_guard()
+    {
+        if (profiling)
+            profile_unwind(profiled);
+        vm_top = top;
+        eval_depth = depth;
+        vm_frames.resize(nframes);
+        vm_handlers.resize(nhandlers);
+    }
+};
+
+static cell vm_run(bytecode *entry, frame *fp)
+{
+    static thread_local bool initialised = false;
+    if (!initialised)
+    {
+        vm_stack.resize(16 * 1024);
+        gc_add_marker(mark_vm);
+        initialised = true;
+    }
+#if VM_COMPUTED_GOTO
+    static void *dispatch[] =
+    {
+#define VM_LABEL(name) &&label_##name,
+        VM_OPCODES(VM_LABEL)
+#undef VM_LABEL
+    };
+#endif
+    vm_state_guard guard;
+    bool tail_call = false;
+    symbol *go_tag = 0;
+    bytecode *c = entry;
+    const int *pc = c->ops.data();
+    const cell *k = c->consts.data();
+    cell *stack = vm_stack.data();
+    cell *sp = stack + vm_top;
+    if (vm_top + c->max_stack + 1 > vm_stack.size())
+    {
+        vm_stack.resize(2 * vm_stack.size() + c->max_stack);
+        RELOAD();
+    }
+
+    NEXT();
+#if !VM_COMPUTED_GOTO
+dispatch:
+    switch (*pc++)
+    {
+#endif
+    CASE(OP_HALT):
+        return sp[-1];
+    CASE(OP_RET):
+    {
+        cell result = sp[-1];
+        vm_frame &caller = vm_frames.back();
+        c = caller.fn;
+        pc = caller.pc;
+        fp = caller.env;
+        sp = stack + caller.base;
+        vm_frames.pop_back();
+        eval_depth--;
+        if (profiling)
+            profile_exit();
+        k = c->consts.data();
+        *sp++ = result;
+        NEXT();
+    }
+    CASE(OP_NIL):
+        *sp++ = cell();
+        NEXT();
+    CASE(OP_CONST):
+        *sp++ = k[*pc++];
+        NEXT();
+    CASE(OP_LOCAL0):
+        *sp++ = fp->slots[*pc++];
+        NEXT();
+    CASE(OP_LOCAL1):
+        *sp++ = fp->parent->slots[*pc++];
+        NEXT();
+    CASE(OP_LOCAL):
+    {
+        frame *f = fp;
+        for (int depth = pc[0]; depth > 0; depth--)
+            f = f->parent;
+        *sp++ = f->slots[pc[1]];
+        pc += 2;
+        NEXT();
+    }
+    CASE(OP_GLOBAL):
+        *sp++ = k[*pc++].global->value;
+        NEXT();
+    CASE(OP_SETLOCAL):
+    {
+        frame *f = fp;
+        for (int depth = pc[0]; depth > 0; depth--)
+            f = f->parent;
+        f->slots[pc[1]] = sp[-1];
+        pc += 2;
+        NEXT();
+    }
+    CASE(OP_SETGLOBAL):
+        k[*pc++].global->value = sp[-1];
+        NEXT();
+    CASE(OP_DEFINE):
+        name_function(sp[-1], k[*pc].global->name);
+        k[*pc++].global->value = sp[-1];
+        NEXT();
+    CASE(OP_POP):
+        sp--;
+        NEXT();
+    CASE(OP_POPN):
+        sp -= *pc++;
+        NEXT();
+    CASE(OP_REPLACE):
+        sp[-2] = sp[-1];
+        sp--;
+        NEXT();
+    CASE(OP_JUMP):
+        pc = c->ops.data() + *pc;
+        NEXT();
+    CASE(OP_JUMPIFNIL):
+        sp--;
+        if (IS_NIL(*sp))
+            pc = c->ops.data() + *pc;
+        else
+            pc++;
+        NEXT();
+    CASE(OP_ANDJUMP):
+        if (IS_NIL(sp[-1]))
+            pc = c->ops.data() + *pc;
+        else
+        {
+            sp--;
+            pc++;
+        }
+        NEXT();
+    CASE(OP_ORJUMP):
+        if (!IS_NIL(sp[-1]))
+            pc = c->ops.data() + *pc;
+        else
+        {
+            sp--;
+            pc++;
+        }
+        NEXT();
+    CASE(OP_NOT):
+        sp[-1] = IS_NIL(sp[-1])? cell(&sym_true) : cell();
+        NEXT();
+    CASE(OP_CLOSURE):
+    {
+        bytecode *child = c->children[*pc++];
+        SAVE();
+        cell func(v_function);
+        func.func = make_closure(child->args, child->body, fp, child->nslots);
+        func.func->bc = child;
+        *sp++ = func;
+        NEXT();
+    }
+    CASE(OP_GLOBALCALL):
+    {
+        const cell &callee = k[*pc++].global->value;
+        *sp++ = callee;
+        if (callee.type == v_function || callee.type == v_primitive)       //can't be special: the arguments are next.
+        {
+            pc += 2;
+            NEXT();
+        }
+        goto prepcall;
+    }
+    CASE(OP_PREPCALL):
+    prepcall:
+    {
+        const cell &callee = sp[-1];
+        if ((callee.type == v_proc && special_native(callee.proc)) || callee.type == v_macro)
+        {
+            SAVE();
+            env = fp;
+            cell result = proc_eval(k[pc[0]]);
+            RELOAD();
+            if (pending_go)
+            {
+                go_tag = pending_go;
+                goto dynamic_go;
+            }
+            sp[-1] = result;
+            pc = c->ops.data() + pc[1];
+        }
+        else
+            pc += 2;
+        NEXT();
+    }
+    CASE(OP_TAILCALL):
+        tail_call = true;
+        goto call;
+    CASE(OP_CALL):
+        tail_call = false;
+    call:
+    {
+        int n = *pc++;
+        cell callee = sp[-n - 1];
+        if (callee.type == v_primitive)
+        {
+            SAVE();
+            cell result;
+            if (profiling)
+            {
+                profile_enter(callee);
+                result = call_primitive(callee.prim, sp - n, n);
+                profile_exit();
+            }
+            else
+                result = call_primitive(callee.prim, sp - n, n);
+            RELOAD();
+            sp -= n + 1;
+            *sp++ = result;
+            NEXT();
+        }
+        if (callee.type == v_proc)
+        {
+            SAVE();
+            env = fp;
+            cell result;
+            if (profiling)
+            {
+                profile_enter(callee);
+                result = call_native(callee.proc, sp - n, n);
+                profile_exit();
+            }
+            else
+                result = call_native(callee.proc, sp - n, n);
+            RELOAD();
+            if (pending_go)
+            {
+                go_tag = pending_go;
+                goto dynamic_go;
+            }
+            sp -= n + 1;
+            *sp++ = result;
+            NEXT();
+        }
+        if (callee.type != v_function)
+            throw(exception("Error: attempt to call non-proc"));
+        closure *func = callee.func;
+        SAVE();
+        if (!func->bc)
+            func->bc = compile_function(func->args, func->body, func->nslots);      //made by proc_eval - compile on first call.
+        bytecode *fn = func->bc;
+        if (n < fn->nparams || (fn->rest != rest_none && n == fn->nparams) || fn->rest == rest_trailing)
+            throw(exception("Error: too few arguments to function"));
+        if (fn->rest == rest_none && n > fn->nparams)
+            throw(exception("Error: too many arguments to function"));
+        if (fn->rest == rest_unnamed)
+            throw(exception("Error: expected name for &rest parameter"));
+        frame *callee_env = make_frame(func->env, func->nslots);
+        cell *args = sp - n;
+        for (int i = 0; i < fn->nparams; i++)
+            callee_env->slots[i] = args[i];
+        if (fn->rest == rest_ok)
+        {
+            cell rest(v_list);
+            for (int i = n; i-- > fn->nparams;)
+                rest = cell(args[i], rest);
+            callee_env->slots[fn->nparams] = rest;
+        }
+        if (tail_call && vm_frames.size() > guard.nframes)
+        {
+            sp = stack + vm_frames.back().base;         //the arguments are in the new frame, so nothing of ours is needed.
+            if (profiling)
+                profile_exit();
+        }
+        else
+        {
+            if (eval_depth >= max_eval_depth)
+                throw(exception("Error: maximum evaluation depth exceeded."));
+            vm_frame caller = {c, pc, fp, (size_t)(args - 1 - stack)};
+            vm_frames.push_back(caller);
+            eval_depth++;
+            sp = args - 1;
+        }
+        if (profiling)
+            profile_enter(callee);
+        c = fn;
+        k = c->consts.data();
+        pc = c->ops.data();
+        fp = callee_env;
+        if ((size_t)(sp - stack) + c->max_stack + 1 > vm_stack.size())
+        {
+            SAVE();
+            vm_stack.resize(2 * vm_stack.size() + c->max_stack);
+            RELOAD();
+        }
+        NEXT();
+    }
+    CASE(OP_LET):
+    {
+        int n = *pc++;
+        SAVE();
+        frame *let_env = make_frame(fp, n);
+        sp -= n;
+        for (int i = 0; i < n; i++)
+            let_env->slots[i] = sp[i];
+        fp = let_env;
+        NEXT();
+    }
+    CASE(OP_LEAVE):
+        fp = fp->parent;
+        NEXT();
+    CASE(OP_TAGBODY):
+    {
+        *sp++ = cell();
+        vm_handler handler = {c, *pc++, vm_frames.size(), (size_t)(sp - stack), fp, profile_depth()};
+        vm_handlers.push_back(handler);
+        NEXT();
+    }
+    CASE(OP_ENDTAGBODY):
+        vm_handlers.pop_back();
+        NEXT();
+    CASE(OP_GO):
+        go_tag = k[*pc++].sym;
+        goto dynamic_go;
+    CASE(OP_CLOCK):
+        *sp++ = cell((long long)std::chrono::steady_clock::now().time_since_epoch().count());
+        NEXT();
+    CASE(OP_TIME):
+        report_time(std::chrono::steady_clock::time_point(std::chrono::steady_clock::duration(sp[-2].i)));
+        sp[-2] = sp[-1];
+        sp--;
+        NEXT();
+    CASE(OP_QQSTART):
+        *sp++ = cell(v_list);
+        *sp++ = cell(v_list);
+        NEXT();
+    CASE(OP_QQAPPEND):
+    {
+        SAVE();
+        cell node = cell(sp[-1], cell(v_list));
+        sp--;
+        if (sp[-1].pair)
+            sp[-1].pair->cdr = node;
+        else
+            sp[-2] = node;
+        sp[-1] = node;
+        NEXT();
+    }
+    CASE(OP_QQSPLICE):
+    {
+        if (sp[-1].type != v_list)
+            throw(exception("Error: attempt to splice non-list (,@)"));
+        SAVE();
+        const cell *iter = &sp[-1];
+        while (iter && iter->car())
+        {
+            cell node = cell(*iter->car(), cell(v_list));       //copy - the spliced list may be someone's data.
+            if (sp[-2].pair)
+                sp[-2].pair->cdr = node;
+            else
+                sp[-3] = node;
+            sp[-2] = node;
+            iter = iter->cdr();
+        }
+        sp--;
+        NEXT();
+    }
+    CASE(OP_QQEND):
+        sp--;
+        NEXT();
+    CASE(OP_NREVERSE):
+    {
+        if (sp[-1].type != v_list)
+            throw(exception("Error: expected list as argument to nreverse."));
+        cell last(v_list);
+        cell tail = sp[-1];
+        while (tail.car())
+        {
+            cell next = *tail.cdr();
+            *tail.cdr() = last;
+            last = tail;
+            tail = next;
+        }
+        sp[-1] = last;
+        NEXT();
+    }
+    CASE(OP_TAILMACROCALL):
+        tail_call = true;
+        goto macro_call;
+    CASE(OP_MACROCALL):         //run the expansion like a call that shares our frame, so deep recursion through macros stays off the C++ stack.
+        tail_call = false;
+    macro_call:
+    {
+        const cell &node = k[*pc++];
+        SAVE();
+        env = fp;
+        bytecode *fn = compile_macro_call(node);
+        RELOAD();
+        if (pending_go)
+        {
+            go_tag = pending_go;
+            goto dynamic_go;
+        }
+        if (!tail_call)             //in tail position the expansion can return straight to our caller.
+        {
+            if (eval_depth >= max_eval_depth)
+                throw(exception("Error: maximum evaluation depth exceeded."));
+            vm_frame caller = {c, pc, fp, (size_t)(sp - stack)};
+            vm_frames.push_back(caller);
+            eval_depth++;
+        }
+        else if (profiling)
+            profile_exit();
+        if (profiling)
+            profile_enter(node.cdr()->car()->global->value);
+        c = fn;
+        k = c->consts.data();
+        pc = c->ops.data();
+        if ((size_t)(sp - stack) + c->max_stack + 1 > vm_stack.size())
+        {
+            SAVE();
+            vm_stack.resize(2 * vm_stack.size() + c->max_stack);
+            RELOAD();
+        }
+        NEXT();
+    }
+    CASE(OP_TREEWALK):
+    {
+        const cell &form = k[*pc++];
+        SAVE();
+        env = fp;
+        cell result = proc_eval(form);
+        RELOAD();
+        if (pending_go)
+        {
+            go_tag = pending_go;
+            goto dynamic_go;
+        }
+        *sp++ = result;
+        NEXT();
+    }
+#if !VM_COMPUTED_GOTO
+    default:
+        throw(exception("Error: bad opcode (vm)"));
+    }
+#endif
+
+dynamic_go:                 //a go from somewhere we couldn't jump directly - find the tagbody it's for.
+    {
+        size_t i = vm_handlers.size();
+        std::map<symbol*, int>::iterator target;
+        bool found = false;
+        while (!found && i > guard.nhandlers)
+        {
+            i--;
+            std::map<symbol*, int> &tags = vm_handlers[i].fn->tagbodies[vm_handlers[i].tagbody];
+            found = (target = tags.find(go_tag)) != tags.end();
+        }
+        if (!found)
+        {
+            pending_go = go_tag;            //not ours - leave it for whoever called us.
+            return cell();
+        }
+        pending_go = 0;
+        vm_handler handler = vm_handlers[i];
+        vm_handlers.resize(i + 1);
+        eval_depth -= vm_frames.size() - handler.nframes;
+        vm_frames.resize(handler.nframes);
+        if (profiling)
+            profile_unwind(handler.profile_depth);
+        c = handler.fn;
+        k = c->consts.data();
+        pc = c->ops.data() + target->second;
+        fp = handler.env;
+        stack = vm_stack.data();
+        sp = stack + handler.sp;
+        NEXT();
+    }
+}
+
+static bytecode* compile_macro_call(const cell &node)
+{
+    closure *expansion = macro_call_expansion(node);
+    if (!expansion->bc)
+        expansion->bc = compile_function(expansion->args, expansion->body, 0);     //ends in RET, like a call.
+    return expansion->bc;
+}
+
+cell vm_eval(const cell &x)
+{
+    cell analyzed = analyze(x, cell(v_list));
+    return vm_run(compile_toplevel(analyzed, OP_HALT), 0);
+}
@@ -0,0 +1,42 @@
+#ifndef VM_H_INCLUDED
+#define VM_H_INCLUDED
+
+#include <map>
+#include <vector>
+
+#include "parser.h"
+
+// Bytecode compiler and stack VM - an alternative to walking the tree with
+// proc_eval. It runs the same analyzed forms, frames and globals, so code
+// compiled here and code walked by proc_eval can call each other freely.
+// Special forms are compiled inline; any other native is called with its
+// arguments already evaluated, and anything the compiler doesn't handle is
+// handed back to proc_eval.
+
+struct bytecode             //one per lambda body or top-level form. Lives on the collected heap.
+{
+    std::vector<int> ops;
+    std::vector<cell> consts;
+    std::vector<bytecode*> children;                    //lambdas compiled inside this one
+    std::vector<std::map<symbol*, int> > tagbodies;     //tag -> op index, for go's thrown from further in
+    cell args;              //parameter list and body, for a function
+    cell body;
+    size_t nslots;
+    int nparams;            //parameters before &REST
+    int rest;               //rest_none, rest_ok, or a malformed &REST that fails on call
+    int max_stack;
+};
+
+enum
+{
+    rest_none = 0,
+    rest_ok,
+    rest_unnamed,
+    rest_trailing
+};
+
+cell vm_eval(const cell &x);        //analyze, compile and run a top-level form.
+cell call_native(cell::proc_t proc, const cell *args, int n);      //a native called on arguments that are already evaluated.
+bool special_native(cell::proc_t p);        //natives that don't simply evaluate all their arguments, which the vm compiles inline.
+
+#endif // VM_H_INCLUDED